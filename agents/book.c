@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "book.h"
+#include "game.h"
+#include "zobrist.h"
+
+#define BOOK_MAGIC "TTTBOOK1"
+
+/* A book is this header, then n_entries sorted keys, then one byte per key
+ * holding the move in its low 6 bits and the result in the high 2.
+ */
+struct book_header {
+    char magic[8];
+    uint32_t board_size, goal, allow_exceed, reserved;
+    uint64_t keys_check; /* Books only make sense with the keys they used */
+    uint64_t n_entries;
+};
+
+#define BOOK_MOVE_BITS 6
+#define BOOK_ENTRY_BYTES (sizeof(uint64_t) + 1)
+_Static_assert(MAX_GRIDS <= 1 << BOOK_MOVE_BITS,
+               "Book moves must fit in BOOK_MOVE_BITS");
+
+static struct book_header *book;
+static size_t book_size;
+static const uint64_t *book_keys;
+static const uint8_t *book_moves;
+static size_t book_n_entries;
+
+static uint64_t keys_check(void)
+{
+    uint64_t check = 0;
+    zobrist_init_keys();
+    for (int i = 0; i < N_GRIDS; i++) {
+        for (int p = 0; p < 2; p++)
+            check = check * 0x100000001b3ULL ^ zobrist_table[i][p];
+    }
+    return check;
+}
+
+static void fill_header(struct book_header *header, uint64_t n_entries)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BOOK_MAGIC, sizeof(header->magic));
+    header->board_size = BOARD_SIZE;
+    header->goal = GOAL;
+    header->allow_exceed = ALLOW_EXCEED;
+    header->keys_check = keys_check();
+    header->n_entries = n_entries;
+}
+
+void book_unload(void)
+{
+    if (book)
+        munmap(book, book_size);
+    book = NULL;
+    book_n_entries = 0;
+}
+
+bool book_load(const char *path)
+{
+    book_unload();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct book_header))
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    const struct book_header *header = p;
+    struct book_header expected;
+    fill_header(&expected, header->n_entries);
+    size_t n = header->n_entries;
+    if (memcmp(header, &expected, sizeof(expected)) ||
+        n != ((size_t) st.st_size - sizeof(*header)) / BOOK_ENTRY_BYTES ||
+        sizeof(*header) + n * BOOK_ENTRY_BYTES != (size_t) st.st_size) {
+        munmap(p, st.st_size);
+        return false;
+    }
+    book = p;
+    book_size = st.st_size;
+    book_keys = (const uint64_t *) (header + 1);
+    book_moves = (const uint8_t *) (book_keys + n);
+    book_n_entries = n;
+    return true;
+}
+
+uint64_t book_key(const char *table, int *sym)
+{
+    uint64_t keys[N_SYMMETRIES] = {0};
+    zobrist_init_keys();
+    for (int g = 0; g < N_GRIDS; g++) {
+        if (table[g] == ' ')
+            continue;
+        for (int k = 0; k < N_SYMMETRIES; k++)
+            keys[k] ^= zobrist_table[symmetry_grids[k][g]]
+                                    [PLAYER_INDEX(table[g])];
+    }
+    int best = 0;
+    for (int k = 1; k < N_SYMMETRIES; k++) {
+        if (keys[k] < keys[best])
+            best = k;
+    }
+    *sym = best;
+    return keys[best];
+}
+
+int book_move(const char *table, char player, int *result)
+{
+    /* The board may have changed since the book was loaded */
+    if (!book || book->board_size != (uint32_t) BOARD_SIZE ||
+        book->goal != (uint32_t) GOAL ||
+        book->allow_exceed != (uint32_t) ALLOW_EXCEED)
+        return -1;
+    int n_x = 0, n_o = 0;
+    for (int g = 0; g < N_GRIDS; g++) {
+        n_x += table[g] == 'X';
+        n_o += table[g] == 'O';
+    }
+    /* Positions are only stored with the side to move of their parity */
+    if (player != (n_x == n_o ? 'X' : n_x == n_o + 1 ? 'O' : 0))
+        return -1;
+
+    int sym;
+    uint64_t key = book_key(table, &sym);
+    size_t lo = 0, hi = book_n_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (book_keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == book_n_entries || book_keys[lo] != key)
+        return -1;
+    int stored = book_moves[lo] & ((1 << BOOK_MOVE_BITS) - 1);
+    if (stored >= N_GRIDS)
+        return -1;
+    int move = symmetry_inverse[sym][stored];
+    if (table[move] != ' ')
+        return -1;
+    *result = book_moves[lo] >> BOOK_MOVE_BITS;
+    return move;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const book_entry_t *) a)->key;
+    uint64_t y = ((const book_entry_t *) b)->key;
+    return (x > y) - (x < y);
+}
+
+bool book_save(const char *path, book_entry_t *entries, size_t n)
+{
+    qsort(entries, n, sizeof(*entries), cmp_entries);
+    size_t n_unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!n_unique || entries[i].key != entries[n_unique - 1].key)
+            entries[n_unique++] = entries[i];
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+    struct book_header header;
+    fill_header(&header, n_unique);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < n_unique; i++)
+        ok = fwrite(&entries[i].key, sizeof(entries[i].key), 1, f) == 1;
+    for (size_t i = 0; ok && i < n_unique; i++) {
+        uint8_t packed = entries[i].move | entries[i].result << BOOK_MOVE_BITS;
+        ok = fputc(packed, f) != EOF;
+    }
+    return !fclose(f) && ok;
+}
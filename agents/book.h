@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Opening and endgame book: positions solved offline by bookgen, stored as
+ * the sorted canonical Zobrist keys of the positions followed by the best
+ * move and the result of each. Books are memory-mapped, not read.
+ */
+
+/* Result of the book move for the player to move, in half points */
+enum {
+    BOOK_LOSS,
+    BOOK_DRAW,
+    BOOK_WIN,
+};
+
+typedef struct {
+    uint64_t key; /* Smallest Zobrist key over the 8 symmetries */
+    uint8_t move; /* Best move, seen through the symmetry giving key */
+    uint8_t result;
+} book_entry_t;
+
+/* Map the book in path, replacing the current one. Return false, keeping no
+ * book, if the file is not a book for this board and these Zobrist keys.
+ */
+bool book_load(const char *path);
+void book_unload(void);
+
+/* Return the book move for player in table and set *result, or return -1 if
+ * there is no book or the position is not in it. X is assumed to move first.
+ */
+int book_move(const char *table, char player, int *result);
+
+/* Return the canonical key of table and set *sym to the symmetry giving it */
+uint64_t book_key(const char *table, int *sym);
+
+/* Sort entries, drop duplicate keys and write them to path as a book */
+bool book_save(const char *path, book_entry_t *entries, size_t n);
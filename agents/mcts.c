@@ -1,22 +1,171 @@
 #include <assert.h>
 #include <float.h>
-#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "book.h"
 #include "game.h"
 #include "mcts.h"
 #include "util.h"
+#include "zobrist.h"
 
+int mcts_threads = 1;
+int mcts_tree_parallel = 0;
+int mcts_transpositions = 0;
+int mcts_rave = 0;
+int mcts_time_budget = 0;
+
+/* Iterations between two looks at the clock */
+#define CLOCK_BATCH 256
+
+#define ONE (1UL << FIXED_SCALE_BITS)
+
+/* Tree nodes live in a pool and refer to each other by index. The children
+ * of a node are created together, so they occupy n_children consecutive
+ * slots starting at first_child.
+ *
+ * n_visits counts an iteration as soon as it passes through the node, while
+ * score only grows once the playout result comes back. In a shared tree this
+ * makes paths taken by other threads look temporarily lost (virtual loss).
+ *
+ * With RAVE, the amaf_ fields count the iterations in which the player to
+ * move at the parent played move at any later point (all moves as first).
+ */
 struct node {
-    int move;
+    unsigned long score;
+    unsigned long amaf_score; /* Results of playouts where move came later */
+    int n_visits;
+    int amaf_visits;
+    int parent;
+    int first_child; /* UNEXPANDED, EXPANDING, or index of first child */
+    short n_children;
+    signed char move;
     char player;
+};
+
+_Static_assert(MAX_GRIDS <= 127, "Moves must fit in struct node");
+
+#define UNEXPANDED (-1)
+#define EXPANDING (-2)
+
+#define NODE_POOL_MIN 4096
+
+struct node_pool {
+    struct node *nodes;
+    int used, capacity;
+};
+
+/* A search tree, rooted at index 0 of *pool. When the tree is carried over
+ * to the next move, the surviving subtree is copied into the other pool,
+ * which drops the discarded siblings at once.
+ */
+struct tree {
+    struct node_pool pools[2];
+    struct node_pool *pool;
+    bitboard_t boards[2]; /* Position at the root */
+    unsigned generation;  /* game_generation the tree was built for */
+};
+
+/* With root parallelism every thread owns a tree; otherwise trees[0] is
+ * searched, by all threads at once in tree parallel mode.
+ */
+static struct tree trees[MCTS_MAX_THREADS];
+
+/* In transposition mode statistics belong to positions, found by Zobrist
+ * key with linear probing; a free slot has key 0. Keys also cover the
+ * player to move, so that the empty board does not hash to 0.
+ */
+struct position {
+    uint64_t key;
+    bitboard_t boards[2];
+    unsigned long score; /* Sum of results for the player who moved last */
     int n_visits;
-    unsigned long score;
-    struct node *parent;
-    struct node *children[N_GRIDS];
 };
 
+#define POSITION_TABLE_MIN 4096
+
+struct position_table {
+    struct position *slots;
+    int used, mask;
+};
+
+/* Like a tree, the positions that can still arise from the next root are
+ * moved to the other table between searches.
+ */
+struct dag {
+    struct position_table tables[2];
+    struct position_table *table;
+    unsigned generation; /* game_generation the positions were found in */
+};
+
+static struct dag dags[MCTS_MAX_THREADS];
+
+static const uint64_t side_keys[2] = {0x9e3779b97f4a7c15ULL,
+                                      0xbf58476d1ce4e5b9ULL};
+
+/* Key of the position after player marks move */
+static inline uint64_t key_after_move(uint64_t key, int move, char player)
+{
+    return key ^ zobrist_table[move][PLAYER_INDEX(player)] ^ side_keys[0] ^
+           side_keys[1];
+}
+
+/* Grids still free along the current path. pos[] locates each grid in
+ * grids[] so that a grid can be removed in O(1).
+ */
+struct empty_grids {
+    int n;
+    int grids[MAX_GRIDS];
+    int pos[MAX_GRIDS];
+};
+
+static inline void remove_empty_grid(struct empty_grids *empty, int grid)
+{
+    int i = empty->pos[grid];
+    int last = empty->grids[--empty->n];
+    empty->grids[i] = last;
+    empty->pos[last] = i;
+}
+
+/* Position to search from, common to all workers */
+struct root_state {
+    bitboard_t boards[2];
+    struct empty_grids empty;
+    int n_marks;
+    uint64_t key;
+    char player;
+    char win;
+};
+
+/* State of one search thread */
+struct worker {
+    struct node_pool *pool;
+    struct dag *dag; /* Searched instead of pool in transposition mode */
+    const struct root_state *root;
+    long iterations;    /* Iteration cap, 0 for none */
+    uint64_t deadline;  /* Monotonic time in ns to stop at, 0 for none */
+    long done;          /* Iterations run */
+    unsigned long rave; /* RAVE equivalence parameter, 0 if disabled */
+    bool shared;        /* pool is searched by other workers as well */
+    uint64_t rng;
+    pthread_t thread;
+};
+
+/* xorshift64*, so that workers do not contend on the state of rand() */
+static inline uint32_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
 unsigned long fixed_mul(unsigned long a, unsigned long b)
 {
     unsigned long long tmp = (unsigned long long) a * b;
@@ -30,29 +179,6 @@ unsigned long fixed_div(unsigned long a, unsigned long b)
     return (unsigned long) tmp;
 }
 
-unsigned long fixed_log(unsigned long x)
-{
-    unsigned long x_plus_1 = x + (1U << FIXED_SCALE_BITS);
-    unsigned long x_minus_1 = x - (1U << FIXED_SCALE_BITS);
-    unsigned long denominator = fixed_div(x_minus_1, x_plus_1);
-    unsigned long result = 1U << FIXED_SCALE_BITS;
-    unsigned long ratio = fixed_mul(denominator, denominator);
-    unsigned long k = 1;
-
-    while (1) {
-        unsigned long term =
-            fixed_div(ratio, ((2 * k + 1) << FIXED_SCALE_BITS));
-        if (k > 10)
-            break;
-        result += term;
-        ratio = fixed_mul(ratio, ratio);
-        k++;
-    }
-
-    result <<= 1;
-    return fixed_mul(result, denominator);
-}
-
 unsigned long sqrt_fix(unsigned long num)
 {
     unsigned long x = num;
@@ -68,153 +194,861 @@ unsigned long sqrt_fix(unsigned long num)
     return x;
 }
 
-static struct node *new_node(int move, char player, struct node *parent)
+/* Reserve n consecutive nodes and return the first, or -1 on failure.
+ * A shared pool never moves; its capacity is reserved before the search.
+ */
+static int alloc_nodes(struct node_pool *p, int n, bool shared)
+{
+    if (shared) {
+        int first = __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+        do {
+            if (first + n > p->capacity)
+                return -1;
+        } while (!__atomic_compare_exchange_n(&p->used, &first, first + n,
+                                              true, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+        return first;
+    }
+
+    if (p->used + n > p->capacity) {
+        int capacity = p->capacity ? p->capacity : NODE_POOL_MIN;
+        while (p->used + n > capacity)
+            capacity *= 2;
+        struct node *nodes = realloc(p->nodes, capacity * sizeof(*nodes));
+        if (!nodes)
+            return -1;
+        p->nodes = nodes;
+        p->capacity = capacity;
+    }
+    int first = p->used;
+    p->used += n;
+    return first;
+}
+
+/* Make room for at least n nodes in total */
+static void reserve_nodes(struct node_pool *p, int n)
+{
+    if (n <= p->capacity)
+        return;
+    struct node *nodes = realloc(p->nodes, n * sizeof(*nodes));
+    if (!nodes)
+        return;
+    p->nodes = nodes;
+    p->capacity = n;
+}
+
+static void init_node(struct node *node, int move, char player, int parent)
 {
-    struct node *node = malloc(sizeof(struct node));
     node->move = move;
     node->player = player;
     node->n_visits = 0;
     node->score = 0;
+    node->amaf_visits = 0;
+    node->amaf_score = 0;
     node->parent = parent;
-    memset(node->children, 0, sizeof(node->children));
-    return node;
+    node->first_child = UNEXPANDED;
+    node->n_children = 0;
 }
 
-static void free_node(struct node *node)
+/* UCT needs ln(parent visits) and 1 / sqrt(child visits) at every step.
+ * Both are looked up in tables built once; counts beyond the tables are
+ * shifted into range, using ln(n) = ln(n >> k) + k ln 2 and
+ * 1 / sqrt(n) = (1 / sqrt(n >> 2k)) >> k.
+ */
+#define UCT_TABLE_BITS 12
+#define UCT_TABLE_SIZE (1 << UCT_TABLE_BITS)
+#define INV_SQRT_BITS 30
+#define LN2_Q32 0xb17217f8ULL /* ln 2 in Q32 */
+
+static uint32_t log_table[UCT_TABLE_SIZE];      /* ln(n), fixed point */
+static uint32_t inv_sqrt_table[UCT_TABLE_SIZE]; /* 1 / sqrt(n), Q30 */
+static uint32_t fixed_ln2;
+static pthread_once_t uct_tables_once = PTHREAD_ONCE_INIT;
+
+/* log2(n) in Q32, one fractional bit per squaring of the mantissa */
+static uint64_t log2_q32(uint32_t n)
 {
-    for (int i = 0; i < N_GRIDS; i++)
-        if (node->children[i])
-            free_node(node->children[i]);
-    free(node);
+    int k = 31 - __builtin_clz(n);
+    uint64_t result = (uint64_t) k << 32;
+    uint64_t x = ((uint64_t) n << 31) >> k; /* n / 2^k in Q31, in [1, 2) */
+    for (uint64_t bit = 1ULL << 31; bit; bit >>= 1) {
+        x = x * x >> 31;
+        if (x >= 1ULL << 32) {
+            x >>= 1;
+            result |= bit;
+        }
+    }
+    return result;
 }
 
-static inline unsigned long uct_score(int n_total,
+static uint64_t isqrt64(uint64_t x)
+{
+    uint64_t root = 0;
+    for (uint64_t bit = 1ULL << 62; bit; bit >>= 2) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+/* Both tables are rounded to nearest, in integers only */
+static void init_uct_tables(void)
+{
+    for (int n = 1; n < UCT_TABLE_SIZE; n++) {
+        uint64_t lg = log2_q32(n);
+        /* ln(n) = log2(n) ln 2, in Q48 */
+        uint64_t ln = (lg >> 16) * LN2_Q32 + ((lg & 0xffff) * LN2_Q32 >> 16);
+        log_table[n] = (ln + (1ULL << (47 - FIXED_SCALE_BITS))) >>
+                       (48 - FIXED_SCALE_BITS);
+        /* One more bit than needed, to round on */
+        uint64_t root = isqrt64((1ULL << (2 * INV_SQRT_BITS + 2)) / n);
+        inv_sqrt_table[n] = (root + 1) >> 1;
+    }
+    fixed_ln2 = (LN2_Q32 + (1ULL << (31 - FIXED_SCALE_BITS))) >>
+                (32 - FIXED_SCALE_BITS);
+}
+
+static inline unsigned long fixed_log_count(unsigned int n)
+{
+    int k = 0;
+    for (; n >= UCT_TABLE_SIZE; n >>= 1)
+        k++;
+    return log_table[n] + (unsigned long) k * fixed_ln2;
+}
+
+static inline uint64_t inv_sqrt_count(unsigned int n)
+{
+    int k = 0;
+    for (; n >= UCT_TABLE_SIZE; n >>= 2)
+        k++;
+    return inv_sqrt_table[n] >> k;
+}
+
+/* Exploration weight times sqrt(ln(parent visits)), shared by all children */
+static inline unsigned long uct_explore(int n_total)
+{
+    if (n_total < 1)
+        return 0;
+    return fixed_mul(EXPLORATION_FACTOR,
+                     sqrt_fix(fixed_log_count((unsigned int) n_total)));
+}
+
+static inline unsigned long uct_bonus(unsigned long explore, int n_visits)
+{
+    return (explore * inv_sqrt_count((unsigned int) n_visits)) >>
+           INV_SQRT_BITS;
+}
+
+static inline unsigned long uct_score(unsigned long explore,
                                       int n_visits,
                                       unsigned long score)
 {
     if (n_visits == 0)
         return ~0UL;
+    return score / (unsigned long) n_visits + uct_bonus(explore, n_visits);
+}
 
-    unsigned long n_visitsn = (unsigned long) n_visits;
-
-    n_visitsn <<= FIXED_SCALE_BITS;
-
-    unsigned long n_totaln = (unsigned long) n_total;
-    n_totaln <<= FIXED_SCALE_BITS;
-    n_totaln = fixed_log(n_totaln);
-    unsigned long tmp =
-        fixed_mul(256, sqrt_fix(fixed_div(n_totaln, n_visitsn)));
-    return fixed_div(score, n_visitsn) + tmp;
+/* Blend the mean result of a child with its AMAF mean, which is trusted
+ * less as real visits accumulate. For n visits and m AMAF visits the AMAF
+ * weight is m / (n + m + n m / k), Silver's schedule with equivalence
+ * parameter k. Unvisited children still come first, best AMAF mean first.
+ */
+static inline unsigned long rave_score(unsigned long explore,
+                                       const struct node *child,
+                                       unsigned long k)
+{
+    unsigned long n = __atomic_load_n(&child->n_visits, __ATOMIC_RELAXED);
+    unsigned long m = __atomic_load_n(&child->amaf_visits, __ATOMIC_RELAXED);
+    unsigned long amaf_mean =
+        m ? __atomic_load_n(&child->amaf_score, __ATOMIC_RELAXED) / m
+          : ONE / 2;
+    if (n == 0)
+        return ~0UL - ONE + amaf_mean;
+    unsigned long mean = __atomic_load_n(&child->score, __ATOMIC_RELAXED) / n;
+    unsigned long beta = (m << FIXED_SCALE_BITS) / (n + m + n * m / k);
+    return ((ONE - beta) * mean + beta * amaf_mean) / ONE +
+           uct_bonus(explore, n);
 }
 
-static struct node *select_move(struct node *node)
+static int select_move(struct worker *w, int parent)
 {
-    struct node *best_node = NULL;
+    const struct node *node = &w->pool->nodes[parent];
+    const struct node *children = &w->pool->nodes[node->first_child];
+    unsigned long explore =
+        uct_explore(__atomic_load_n(&node->n_visits, __ATOMIC_RELAXED));
+    int best = -1;
     unsigned long best_score = 0UL;
-    for (int i = 0; i < N_GRIDS; i++) {
-        if (!node->children[i])
-            continue;
+    for (int i = 0; i < node->n_children; i++) {
         unsigned long score =
-            uct_score(node->n_visits, node->children[i]->n_visits,
-                      node->children[i]->score);
+            w->rave
+                ? rave_score(explore, &children[i], w->rave)
+                : uct_score(explore,
+                            __atomic_load_n(&children[i].n_visits,
+                                            __ATOMIC_RELAXED),
+                            __atomic_load_n(&children[i].score,
+                                            __ATOMIC_RELAXED));
         if (score > best_score) {
             best_score = score;
-            best_node = node->children[i];
+            best = i;
         }
     }
-    if (!best_node) {
-        while (1) {
-            best_node = node->children[rand() % N_GRIDS];
-            if (best_node)
-                break;
-        }
-    }
-    return best_node;
+    if (best < 0)
+        best = next_random(&w->rng) % node->n_children;
+    return node->first_child + best;
+}
+
+/* Count an iteration passing through a node or position. Return the
+ * previous count.
+ */
+static inline int add_visit(struct worker *w, int *n_visits)
+{
+    if (w->shared)
+        return __atomic_fetch_add(n_visits, 1, __ATOMIC_RELAXED);
+    return (*n_visits)++;
 }
 
-static unsigned long simulate(char *table, char player)
+static inline void add_score(struct worker *w,
+                             unsigned long *sum,
+                             unsigned long score)
+{
+    if (w->shared)
+        __atomic_fetch_add(sum, score, __ATOMIC_RELAXED);
+    else
+        *sum += score;
+}
+
+/* Play random moves from the given position, where player is to move,
+ * leaving the final position in boards. Return the result for the player
+ * who moved last.
+ */
+static unsigned long simulate(struct worker *w,
+                              bitboard_t boards[2],
+                              const struct empty_grids *empty,
+                              int n_marks,
+                              char player)
 {
     char current_player = player;
-    char temp_table[N_GRIDS];
-    memcpy(temp_table, table, N_GRIDS);
-    while (1) {
+    int grids[MAX_GRIDS];
+    int n_empty = empty->n;
+    memcpy(grids, empty->grids, n_empty * sizeof(int));
+    while (n_empty) {
         char win;
-        int *moves = available_moves(temp_table);
-        if (moves[0] == -1) {
-            free(moves);
-            break;
-        }
-        int n_moves = 0;
-        while (n_moves < N_GRIDS && moves[n_moves] != -1)
-            ++n_moves;
-        int move = moves[rand() % n_moves];
-        free(moves);
-        temp_table[move] = current_player;
-        if ((win = check_win(temp_table)) != ' ')
-            return calculate_win_value(win, player);
+        int i = next_random(&w->rng) % n_empty;
+        int move = grids[i];
+        grids[i] = grids[--n_empty];
+        boards[PLAYER_INDEX(current_player)] |= GRID_BIT(move);
+        if ((win = check_win_after_bitboards(boards, move, ++n_marks)) != ' ')
+            return calculate_win_value(win, player ^ 'O' ^ 'X');
         current_player ^= 'O' ^ 'X';
     }
     return ((unsigned long) 1UL << (FIXED_SCALE_BITS - 1));
 }
 
-static void backpropagate(struct node *node, unsigned long score)
+/* Return index of first child of node, or a negative value if unexpanded */
+static inline int first_child(struct worker *w, int index)
+{
+    return __atomic_load_n(&w->pool->nodes[index].first_child,
+                           __ATOMIC_ACQUIRE);
+}
+
+/* Credit the children of node whose move was played later by the player to
+ * move at node, as if it had been played first.
+ */
+static void update_amaf(struct worker *w,
+                        int index,
+                        bitboard_t played,
+                        unsigned long score)
 {
-    while (node) {
-        node->n_visits++;
-        node->score += score;
-        node = node->parent;
-        score = 1 - score;
+    int first = first_child(w, index);
+    if (first < 0)
+        return;
+    for (int i = 0; i < w->pool->nodes[index].n_children; i++) {
+        struct node *child = &w->pool->nodes[first + i];
+        if (played & GRID_BIT(child->move)) {
+            add_visit(w, &child->amaf_visits);
+            add_score(w, &child->amaf_score, score);
+        }
     }
 }
 
-static void expand(struct node *node, char *table)
+/* Add score, the result for the player who moved into index, to the path
+ * up to the root, flipping it for the other player at every level. With
+ * RAVE, played holds the marks made below index, per player.
+ */
+static void backpropagate(struct worker *w,
+                          int index,
+                          unsigned long score,
+                          bitboard_t played[2])
 {
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-    for (int i = 0; i < n_moves; i++) {
-        node->children[i] = new_node(moves[i], node->player ^ 'O' ^ 'X', node);
+    while (index >= 0) {
+        struct node *node = &w->pool->nodes[index];
+        add_score(w, &node->score, score);
+        if (w->rave) {
+            int p = PLAYER_INDEX(node->player);
+            update_amaf(w, index, played[p], ONE - score);
+            if (node->move >= 0)
+                played[!p] |= GRID_BIT(node->move);
+        }
+        index = node->parent;
+        score = ONE - score;
     }
-    free(moves);
 }
 
-int mcts(char *table, char player)
+/* Create one child per empty grid. Return false if the pool is exhausted,
+ * or if another worker is expanding the node.
+ */
+static bool expand(struct worker *w, int index, const struct empty_grids *empty)
 {
-    char win;
-    struct node *root = new_node(-1, player, NULL);
-    for (int i = 0; i < ITERATIONS; i++) {
-        struct node *node = root;
-        char temp_table[N_GRIDS];
-        memcpy(temp_table, table, N_GRIDS);
-        while (1) {
-            if ((win = check_win(temp_table)) != ' ') {
-                unsigned long score =
-                    calculate_win_value(win, node->player ^ 'O' ^ 'X');
-                backpropagate(node, score);
-                break;
+    struct node_pool *pool = w->pool;
+    int expected = UNEXPANDED;
+    if (w->shared &&
+        !__atomic_compare_exchange_n(&pool->nodes[index].first_child,
+                                     &expected, EXPANDING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    int first = alloc_nodes(pool, empty->n, w->shared);
+    struct node *node = &pool->nodes[index];
+    if (first < 0) {
+        __atomic_store_n(&node->first_child, UNEXPANDED, __ATOMIC_RELAXED);
+        return false;
+    }
+    for (int i = 0; i < empty->n; i++)
+        init_node(&pool->nodes[first + i], empty->grids[i],
+                  node->player ^ 'O' ^ 'X', index);
+    node->n_children = empty->n;
+    /* Publish the children only once they are complete */
+    __atomic_store_n(&node->first_child, first, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void iterate(struct worker *w)
+{
+    const struct root_state *root = w->root;
+    int node = 0;
+    bitboard_t temp_boards[2] = {root->boards[0], root->boards[1]};
+    struct empty_grids empty = root->empty;
+    int n_marks = root->n_marks;
+    char win = root->win;
+    bitboard_t played[2] = {0, 0};
+    bool fresh = add_visit(w, &w->pool->nodes[node].n_visits) == 0;
+    while (1) {
+        char player = w->pool->nodes[node].player;
+        if (win != ' ') {
+            backpropagate(w, node, calculate_win_value(win, player ^ 'O' ^ 'X'),
+                          played);
+            return;
+        }
+        if (fresh ||
+            (first_child(w, node) < 0 && !expand(w, node, &empty))) {
+            bitboard_t leaf[2] = {temp_boards[0], temp_boards[1]};
+            unsigned long score =
+                simulate(w, temp_boards, &empty, n_marks, player);
+            played[0] = temp_boards[0] & ~leaf[0];
+            played[1] = temp_boards[1] & ~leaf[1];
+            backpropagate(w, node, score, played);
+            return;
+        }
+        node = select_move(w, node);
+        fresh = add_visit(w, &w->pool->nodes[node].n_visits) == 0;
+        int move = w->pool->nodes[node].move;
+        remove_empty_grid(&empty, move);
+        temp_boards[PLAYER_INDEX(player)] |= GRID_BIT(move);
+        win = check_win_after_bitboards(temp_boards, move, ++n_marks);
+    }
+}
+
+/* Make t empty, with capacity slots (a power of two) */
+static bool reset_positions(struct position_table *t, int capacity)
+{
+    if (!t->slots || capacity != t->mask + 1) {
+        struct position *slots = calloc(capacity, sizeof(*slots));
+        if (!slots)
+            return false;
+        free(t->slots);
+        t->slots = slots;
+        t->mask = capacity - 1;
+    } else {
+        memset(t->slots, 0, capacity * sizeof(*t->slots));
+    }
+    t->used = 0;
+    return true;
+}
+
+/* Return the position with key. If absent and boards is given, add it,
+ * unless that would fill the table beyond 3/4, so that probing always ends
+ * at a free slot. Return NULL if the position is neither found nor added.
+ */
+static struct position *probe_position(struct position_table *t,
+                                       uint64_t key,
+                                       const bitboard_t *boards,
+                                       bool shared)
+{
+    int limit = (t->mask + 1) / 4 * 3;
+    for (int i = key & t->mask;; i = (i + 1) & t->mask) {
+        struct position *pos = &t->slots[i];
+        uint64_t k = __atomic_load_n(&pos->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return pos;
+        if (k)
+            continue;
+        if (!boards || __atomic_load_n(&t->used, __ATOMIC_RELAXED) >= limit)
+            return NULL;
+        if (shared) {
+            /* Another worker may claim the slot first, maybe for key */
+            if (!__atomic_compare_exchange_n(&pos->key, &k, key, false,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE)) {
+                if (k == key)
+                    return pos;
+                continue;
             }
-            if (node->n_visits == 0) {
-                unsigned long score = simulate(temp_table, node->player);
-                backpropagate(node, score);
+            __atomic_fetch_add(&t->used, 1, __ATOMIC_RELAXED);
+        } else {
+            pos->key = key;
+            t->used++;
+        }
+        pos->boards[0] = boards[0];
+        pos->boards[1] = boards[1];
+        return pos;
+    }
+}
+
+/* Move the positions of d->table that contain every mark of boards (all of
+ * them if boards is NULL) to the other table, resized to capacity slots.
+ */
+static bool rehash_positions(struct dag *d,
+                             int capacity,
+                             const bitboard_t *boards)
+{
+    struct position_table *src = d->table;
+    struct position_table *dst = &d->tables[src == &d->tables[0]];
+    if (!reset_positions(dst, capacity))
+        return false;
+    for (int i = 0; i <= src->mask; i++) {
+        const struct position *pos = &src->slots[i];
+        if (!pos->key || (boards && ((boards[0] & ~pos->boards[0]) |
+                                     (boards[1] & ~pos->boards[1]))))
+            continue;
+        *probe_position(dst, pos->key, pos->boards, false) = *pos;
+    }
+    d->table = dst;
+    return true;
+}
+
+/* Make room for n more positions */
+static void reserve_positions(struct dag *d, long n)
+{
+    long needed = (d->table->used + n) * 4 / 3 + 1;
+    long capacity = d->table->mask + 1;
+    if (needed <= capacity)
+        return;
+    while (capacity < needed && capacity <= INT32_MAX / 2)
+        capacity *= 2;
+    rehash_positions(d, capacity, NULL);
+}
+
+/* Pick the position to visit after pos, at the end of the path in key */
+static int select_position_move(struct worker *w,
+                                struct position_table *t,
+                                const struct position *pos,
+                                uint64_t key,
+                                const struct empty_grids *empty,
+                                char player)
+{
+    unsigned long explore =
+        uct_explore(__atomic_load_n(&pos->n_visits, __ATOMIC_RELAXED));
+    int best = -1;
+    unsigned long best_score = 0UL;
+    for (int i = 0; i < empty->n; i++) {
+        const struct position *child = probe_position(
+            t, key_after_move(key, empty->grids[i], player), NULL, false);
+        unsigned long score =
+            child ? uct_score(
+                        explore,
+                        __atomic_load_n(&child->n_visits, __ATOMIC_RELAXED),
+                        __atomic_load_n(&child->score, __ATOMIC_RELAXED))
+                  : ~0UL;
+        if (score > best_score) {
+            best_score = score;
+            best = i;
+        }
+        if (score == ~0UL)
+            break;
+    }
+    if (best < 0)
+        best = next_random(&w->rng) % empty->n;
+    return empty->grids[best];
+}
+
+/* One iteration over the DAG. Positions reached through several paths have
+ * no single parent, so the path is recorded for backpropagation.
+ */
+static void iterate_dag(struct worker *w)
+{
+    const struct root_state *root = w->root;
+    struct position_table *t = w->dag->table;
+    /* An iteration adds at most one position */
+    if (!w->shared && (t->used + 1) * 4 > (t->mask + 1) * 3 &&
+        rehash_positions(w->dag, (t->mask + 1) * 2, NULL))
+        t = w->dag->table;
+
+    struct position *path[MAX_GRIDS + 1];
+    int depth = 0;
+    bitboard_t temp_boards[2] = {root->boards[0], root->boards[1]};
+    struct empty_grids empty = root->empty;
+    int n_marks = root->n_marks;
+    uint64_t key = root->key;
+    char player = root->player;
+    char win = root->win;
+    struct position *pos = probe_position(t, key, NULL, false);
+    unsigned long score;
+    path[depth++] = pos;
+    bool fresh = add_visit(w, &pos->n_visits) == 0;
+    while (1) {
+        if (win != ' ') {
+            score = calculate_win_value(win, player ^ 'O' ^ 'X');
+            break;
+        }
+        if (fresh) {
+            score = simulate(w, temp_boards, &empty, n_marks, player);
+            break;
+        }
+        int move = select_position_move(w, t, pos, key, &empty, player);
+        key = key_after_move(key, move, player);
+        remove_empty_grid(&empty, move);
+        temp_boards[PLAYER_INDEX(player)] |= GRID_BIT(move);
+        win = check_win_after_bitboards(temp_boards, move, ++n_marks);
+        player ^= 'O' ^ 'X';
+        pos = probe_position(t, key, temp_boards, w->shared);
+        if (!pos) {
+            /* Table full: play out from the new position without it */
+            score = win != ' '
+                        ? calculate_win_value(win, player ^ 'O' ^ 'X')
+                        : simulate(w, temp_boards, &empty, n_marks, player);
+            score = ONE - score;
+            break;
+        }
+        path[depth++] = pos;
+        fresh = add_visit(w, &pos->n_visits) == 0;
+    }
+
+    while (depth--) {
+        add_score(w, &path[depth]->score, score);
+        score = ONE - score;
+    }
+}
+
+/* Root the DAG at the given position. Return false if out of memory. */
+static bool prepare_dag(struct dag *d, const struct root_state *root)
+{
+    if (!d->table)
+        d->table = &d->tables[0];
+    struct position_table *t = d->table;
+    if (t->slots && d->generation == game_generation &&
+        probe_position(t, root->key, NULL, false)) {
+        if (!rehash_positions(d, t->mask + 1, root->boards))
+            return false;
+    } else if (!reset_positions(t, t->slots ? t->mask + 1
+                                            : POSITION_TABLE_MIN)) {
+        return false;
+    }
+    d->generation = game_generation;
+    return probe_position(d->table, root->key, root->boards, false);
+}
+
+/* Add the statistics of the positions after each root move */
+static void count_root_positions(struct dag *d,
+                                 const struct root_state *root,
+                                 long visits[MAX_GRIDS],
+                                 unsigned long scores[MAX_GRIDS])
+{
+    for (int i = 0; i < root->empty.n; i++) {
+        int move = root->empty.grids[i];
+        uint64_t key = key_after_move(root->key, move, root->player);
+        const struct position *pos =
+            probe_position(d->table, key, NULL, false);
+        if (pos) {
+            visits[move] += pos->n_visits;
+            scores[move] += pos->score;
+        }
+    }
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *search(void *arg)
+{
+    struct worker *w = arg;
+    long i;
+    for (i = 0; !w->iterations || i < w->iterations; i++) {
+        if (w->deadline && i && !(i % CLOCK_BATCH) &&
+            monotonic_ns() >= w->deadline)
+            break;
+        if (w->dag)
+            iterate_dag(w);
+        else
+            iterate(w);
+    }
+    w->done = i;
+    return NULL;
+}
+
+/* Make the subtree at index the whole tree, moving it to the other pool in
+ * breadth-first order so that siblings stay consecutive.
+ */
+static bool compact_tree(struct tree *t, int index)
+{
+    struct node_pool *src = t->pool, *dst = &t->pools[t->pool == &t->pools[0]];
+    dst->used = 0;
+    if (alloc_nodes(dst, 1, false) < 0)
+        return false;
+    dst->nodes[0] = src->nodes[index];
+    dst->nodes[0].parent = -1;
+
+    /* Until visited, a copied node still holds its children's source index */
+    for (int i = 0; i < dst->used; i++) {
+        int n = dst->nodes[i].n_children;
+        if (!n)
+            continue;
+        int first = alloc_nodes(dst, n, false);
+        if (first < 0)
+            return false;
+        memcpy(&dst->nodes[first], &src->nodes[dst->nodes[i].first_child],
+               n * sizeof(struct node));
+        for (int j = 0; j < n; j++)
+            dst->nodes[first + j].parent = i;
+        dst->nodes[i].first_child = first;
+    }
+
+    t->pool = dst;
+    src->used = 0;
+    return true;
+}
+
+/* Find the position given by boards below the root of the previous search,
+ * following the moves played since, and make it the root. Return false if
+ * the previous tree cannot be reused.
+ */
+static bool reuse_tree(struct tree *t, const bitboard_t boards[2], char player)
+{
+    struct node_pool *pool = t->pool;
+    if (!pool->used || (t->boards[0] & ~boards[0]) ||
+        (t->boards[1] & ~boards[1]))
+        return false;
+
+    bitboard_t played[2] = {boards[0] & ~t->boards[0],
+                            boards[1] & ~t->boards[1]};
+    int index = 0;
+    while (played[0] | played[1]) {
+        const struct node *node = &pool->nodes[index];
+        int p = PLAYER_INDEX(node->player);
+        int next = -1;
+        for (int i = 0; i < node->n_children; i++) {
+            if (played[p] & GRID_BIT(pool->nodes[node->first_child + i].move)) {
+                next = node->first_child + i;
                 break;
             }
-            if (node->children[0] == NULL)
-                expand(node, temp_table);
-            node = select_move(node);
-            assert(node);
-            temp_table[node->move] = node->player ^ 'O' ^ 'X';
         }
+        if (next < 0)
+            return false;
+        played[p] &= ~GRID_BIT(pool->nodes[next].move);
+        index = next;
+    }
+
+    return pool->nodes[index].player == player && compact_tree(t, index);
+}
+
+/* Root the tree at the given position. Return false if out of memory. */
+static bool prepare_tree(struct tree *t,
+                         const bitboard_t boards[2],
+                         char player)
+{
+    if (!t->pool)
+        t->pool = &t->pools[0];
+    if (t->generation != game_generation || !reuse_tree(t, boards, player)) {
+        t->pool->used = 0;
+        if (alloc_nodes(t->pool, 1, false) < 0)
+            return false;
+        init_node(&t->pool->nodes[0], -1, player, -1);
     }
-    struct node *best_node = NULL;
-    int most_visits = -1;
-    for (int i = 0; i < N_GRIDS; i++) {
-        if (root->children[i] && root->children[i]->n_visits > most_visits) {
-            most_visits = root->children[i]->n_visits;
-            best_node = root->children[i];
+    t->boards[0] = boards[0];
+    t->boards[1] = boards[1];
+    t->generation = game_generation;
+    return true;
+}
+
+/* Add the statistics of the root children of t to those of their moves */
+static void count_root_visits(const struct tree *t,
+                              long visits[MAX_GRIDS],
+                              unsigned long scores[MAX_GRIDS])
+{
+    const struct node *root = &t->pool->nodes[0];
+    if (root->first_child < 0)
+        return;
+    for (int i = 0; i < root->n_children; i++) {
+        const struct node *child = &t->pool->nodes[root->first_child + i];
+        visits[(int) child->move] += child->n_visits;
+        scores[(int) child->move] += child->score;
+    }
+}
+
+/* Iterations per millisecond of the last timed search */
+static long iterations_per_ms;
+
+/* Iterations a search within limits can run, to size a shared tree: the
+ * cap if there is one, else as many as the last timed search managed in
+ * the time budget.
+ */
+static long expected_iterations(const mcts_limits_t *limits)
+{
+    long n = limits->iterations;
+    if (!n && limits->time_ms > 0 && iterations_per_ms > 0)
+        n = limits->time_ms * iterations_per_ms;
+    if (!n)
+        n = ITERATIONS;
+    return n < INT32_MAX / (2 * MAX_GRIDS) ? n : INT32_MAX / (2 * MAX_GRIDS);
+}
+
+mcts_result_t mcts_search(char *table,
+                          char player,
+                          const mcts_limits_t *limits)
+{
+    mcts_result_t result = {.move = -1};
+    int book_result;
+    result.move = book_move(table, player, &book_result);
+    if (result.move >= 0) {
+        result.win_rate = book_result / 2.0;
+        return result;
+    }
+    pthread_once(&uct_tables_once, init_uct_tables);
+    int n_threads = mcts_threads < 1                  ? 1
+                    : mcts_threads > MCTS_MAX_THREADS ? MCTS_MAX_THREADS
+                                                      : mcts_threads;
+    bool tree_parallel = mcts_tree_parallel && n_threads > 1;
+    int n_trees = tree_parallel ? 1 : n_threads;
+
+    struct root_state root = {.empty = {.n = 0}, .player = player};
+    table_to_bitboards(table, root.boards);
+    root.win = check_win_bitboards(root.boards);
+    root.n_marks = __builtin_popcountll(root.boards[0] | root.boards[1]);
+    bitboard_t free_grids = ~(root.boards[0] | root.boards[1]) & BOARD_MASK;
+    while (free_grids) {
+        int grid = bitboard_pop(&free_grids);
+        root.empty.pos[grid] = root.empty.n;
+        root.empty.grids[root.empty.n++] = grid;
+    }
+    zobrist_init_keys();
+    root.key = side_keys[PLAYER_INDEX(player)];
+    for (int p = 0; p < 2; p++) {
+        for (bitboard_t marks = root.boards[p]; marks;)
+            root.key ^= zobrist_table[bitboard_pop(&marks)][p];
+    }
+
+    bool transpositions = mcts_transpositions;
+    for (int i = 0; i < n_trees; i++) {
+        if (transpositions ? !prepare_dag(&dags[i], &root)
+                           : !prepare_tree(&trees[i], root.boards, player))
+            return result;
+    }
+    /* Every iteration expands at most one node, into at most
+     * root.empty.n children, or adds at most one position.
+     */
+    long cap = limits->iterations;
+    if (!cap && limits->time_ms <= 0)
+        cap = ITERATIONS;
+    if (tree_parallel && transpositions)
+        reserve_positions(&dags[0], expected_iterations(limits));
+    else if (tree_parallel)
+        reserve_nodes(trees[0].pool,
+                      trees[0].pool->used +
+                          expected_iterations(limits) * root.empty.n);
+    uint64_t start = monotonic_ns();
+    uint64_t deadline =
+        limits->time_ms > 0 ? start + limits->time_ms * 1000000ULL : 0;
+
+    struct worker workers[MCTS_MAX_THREADS];
+    for (int i = 0; i < n_threads; i++) {
+        workers[i] = (struct worker){
+            .pool = trees[tree_parallel ? 0 : i].pool,
+            .dag = transpositions ? &dags[tree_parallel ? 0 : i] : NULL,
+            .root = &root,
+            .iterations = cap ? cap / n_threads + (i < cap % n_threads) : 0,
+            .deadline = deadline,
+            .rave = mcts_rave > 0 ? mcts_rave : 0,
+            .shared = tree_parallel,
+            .rng = ((uint64_t) rand() << 32 | (uint64_t) rand()) | 1,
+        };
+    }
+    int n_started = 1;
+    for (; n_started < n_threads; n_started++) {
+        if (pthread_create(&workers[n_started].thread, NULL, search,
+                           &workers[n_started]))
+            break;
+    }
+    /* Iterations of threads that failed to start are run here */
+    for (int i = n_started; cap && i < n_threads; i++)
+        workers[0].iterations += workers[i].iterations;
+    search(&workers[0]);
+    for (int i = 1; i < n_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (int i = 0; i < n_started; i++)
+        result.iterations += workers[i].done;
+
+    uint64_t elapsed_ms = (monotonic_ns() - start) / 1000000;
+    if (deadline && elapsed_ms)
+        iterations_per_ms = result.iterations / elapsed_ms;
+
+    long visits[MAX_GRIDS] = {0};
+    unsigned long scores[MAX_GRIDS] = {0};
+    for (int i = 0; i < n_trees; i++) {
+        if (transpositions) {
+            count_root_positions(&dags[i], &root, visits, scores);
+            result.tree_size += dags[i].table->used;
+        } else {
+            count_root_visits(&trees[i], visits, scores);
+            result.tree_size += trees[i].pool->used;
         }
     }
-    int best_move = best_node->move;
-    free_node(root);
-    return best_move;
-}
\ No newline at end of file
+
+    long most_visits = -1;
+    for (int i = 0; i < root.empty.n; i++) {
+        int move = root.empty.grids[i];
+        if (visits[move] > most_visits) {
+            most_visits = visits[move];
+            result.move = move;
+        }
+    }
+    if (most_visits > 0)
+        result.win_rate =
+            (double) scores[result.move] / most_visits / (double) ONE;
+    return result;
+}
+
+int mcts(char *table, char player)
+{
+    mcts_limits_t limits = {
+        .time_ms = mcts_time_budget,
+        .iterations = mcts_time_budget > 0 ? 0 : ITERATIONS,
+    };
+    return mcts_search(table, player, &limits).move;
+}
+
+void mcts_reset(void)
+{
+    for (int i = 0; i < MCTS_MAX_THREADS; i++) {
+        if (trees[i].pool)
+            trees[i].pool->used = 0;
+        if (dags[i].table && dags[i].table->slots)
+            reset_positions(dags[i].table, dags[i].table->mask + 1);
+    }
+}
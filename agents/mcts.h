@@ -3,4 +3,54 @@
 #define ITERATIONS 100000
 #define EXPLORATION_FACTOR 256
 
-int mcts(char *table, char player);
\ No newline at end of file
+#define MCTS_MAX_THREADS 64
+
+/* Number of search threads */
+extern int mcts_threads;
+
+/* With several threads, search one shared tree (nonzero) or one tree per
+ * thread, summing the visits of the root moves (zero).
+ */
+extern int mcts_tree_parallel;
+
+/* Keep statistics per position instead of per path (nonzero), so that
+ * transposed move orders share them and the tree becomes a DAG.
+ */
+extern int mcts_transpositions;
+
+/* RAVE equivalence parameter: roughly the number of visits at which a move's
+ * own results weigh as much as its all-moves-as-first results. 0 disables
+ * RAVE, which transposition mode does not use.
+ */
+extern int mcts_rave;
+
+/* Wall-clock budget of a search in milliseconds. When positive, mcts() runs
+ * until the budget is spent instead of running ITERATIONS iterations.
+ */
+extern int mcts_time_budget;
+
+typedef struct {
+    int time_ms;     /* Wall-clock budget, 0 for none */
+    long iterations; /* Iteration cap, 0 for none */
+} mcts_limits_t;
+
+typedef struct {
+    int move;         /* Best move found, or -1 */
+    long iterations;  /* Iterations run, over all threads */
+    long tree_size;   /* Nodes or positions in the search tree(s) */
+    double win_rate;  /* Expected result of move for player, from 0 to 1 */
+} mcts_result_t;
+
+/* Search until either limit is reached, checking the clock every few
+ * hundred iterations, and return the best move found so far. With neither
+ * limit, run ITERATIONS iterations. Positions in the loaded book are
+ * answered from it without searching.
+ */
+mcts_result_t mcts_search(char *table,
+                          char player,
+                          const mcts_limits_t *limits);
+
+int mcts(char *table, char player);
+
+/* Forget the trees kept for reuse by the next search */
+void mcts_reset(void);
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "book.h"
 #include "game.h"
 #include "negamax.h"
 #include "util.h"
@@ -12,90 +17,376 @@
 
 #define MAX_SEARCH_DEPTH 6
 
-static int history_score_sum[N_GRIDS];
-static int history_count[N_GRIDS];
+/* Half width of the first window around the previous iteration's score */
+#define ASPIRATION_WINDOW 10
 
-static uint64_t hash_value;
+/* Nodes between two looks at the clock */
+#define CLOCK_CHECK_NODES 1024
 
-static int cmp_moves(const void *a, const void *b)
+/* Above any evaluation, even of the largest boards */
+#define SCORE_INF 1000000000
+
+/* Score of a won game in exact mode, above any evaluation */
+#define SCORE_WIN (SCORE_INF / 2)
+
+int negamax_time_budget = 0;
+int negamax_threads = 1;
+int negamax_symmetry = 0;
+
+/* Everything a search thread changes while it searches. Threads only share
+ * the transposition table, through which they help each other (Lazy SMP).
+ */
+struct search_state {
+    bitboard_t boards[2];
+    int n_marks, root_marks;
+    eval_t eval;
+    /* Zobrist key of the position under each symmetry; only keys[0], the
+     * literal board, unless n_keys is N_SYMMETRIES.
+     */
+    uint64_t keys[N_SYMMETRIES];
+    int n_keys;
+    long history_score_sum[MAX_GRIDS];
+    int history_count[MAX_GRIDS];
+    int history_mean[MAX_GRIDS]; /* history_score_sum / history_count */
+    /* Last two moves that caused a cutoff at each ply */
+    int killers[MAX_GRIDS][2];
+    /* Best root move of the previous iteration, searched first */
+    int root_best_move;
+    long n_nodes;
+
+    /* Deepest iteration completed, and its result */
+    int depth_done;
+    move_t result;
+
+    char player;
+    int first_depth, max_depth;
+    pthread_t thread;
+};
+
+static struct timespec deadline;
+static bool check_deadline;
+static bool stop_search; /* Set once the clock runs out or the main thread
+                          * has its answer; read by every thread */
+static bool solve_exact; /* Score finished games, not the evaluation */
+
+static bool past_deadline(void)
 {
-    int *_a = (int *) a, *_b = (int *) b;
-    int score_a = 0, score_b = 0;
-
-    if (history_count[*_a])
-        score_a = history_score_sum[*_a] / history_count[*_a];
-    if (history_count[*_b])
-        score_b = history_score_sum[*_b] / history_count[*_b];
-    return score_b - score_a;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
 }
 
-static move_t negamax(char *table, int depth, char player, int alpha, int beta)
+static inline bool stopped(void)
 {
-    if (check_win(table) != ' ' || depth == 0) {
-        move_t result = {get_score(table, player), -1};
+    return __atomic_load_n(&stop_search, __ATOMIC_RELAXED);
+}
+
+static inline void toggle_mark(struct search_state *s, int move, int p)
+{
+    for (int k = 0; k < s->n_keys; k++)
+        s->keys[k] ^= zobrist_table[symmetry_grids[k][move]][p];
+}
+
+/* Return the smallest of the symmetric keys, which all symmetric positions
+ * share, and set *sym to the symmetry producing it.
+ */
+static inline uint64_t canonical_key(const struct search_state *s, int *sym)
+{
+    int best = 0;
+    for (int k = 1; k < s->n_keys; k++) {
+        if (s->keys[k] < s->keys[best])
+            best = k;
+    }
+    *sym = best;
+    return s->keys[best];
+}
+
+/* Fill moves with the empty grids, best first: the move found before (by the
+ * previous iteration at the root, in the table elsewhere), then the killers
+ * of this ply, then the rest by mean history score. Return their number.
+ */
+static int order_moves(const struct search_state *s,
+                       int first_move,
+                       int moves[MAX_GRIDS])
+{
+    const int *killers = s->killers[s->n_marks - s->root_marks];
+    int keys[MAX_GRIDS];
+    int n_moves = 0;
+    bitboard_t empty = ~(s->boards[0] | s->boards[1]) & BOARD_MASK;
+    while (empty) {
+        int move = bitboard_pop(&empty);
+        int key = move == first_move   ? INT_MAX
+                  : move == killers[0] ? INT_MAX - 1
+                  : move == killers[1] ? INT_MAX - 2
+                                       : s->history_mean[move];
+        /* Insertion sort; there are at most N_GRIDS moves */
+        int i = n_moves++;
+        for (; i > 0 && keys[i - 1] < key; i--) {
+            keys[i] = keys[i - 1];
+            moves[i] = moves[i - 1];
+        }
+        keys[i] = key;
+        moves[i] = move;
+    }
+    return n_moves;
+}
+
+static void add_killer(struct search_state *s, int move)
+{
+    int *killers = s->killers[s->n_marks - s->root_marks];
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+}
+
+/* last_move is the grid taken by the previous ply, or -1 at the root */
+static move_t negamax(struct search_state *s,
+                      int depth,
+                      char player,
+                      int alpha,
+                      int beta,
+                      int last_move)
+{
+    char win = last_move < 0 ? check_win_bitboards(s->boards)
+                             : check_win_after_bitboards(s->boards, last_move,
+                                                         s->n_marks);
+    if (win != ' ' || depth == 0) {
+        move_t result = {eval_score(&s->eval, player), -1};
+        /* The player to move has lost; the sooner, the worse */
+        if (solve_exact && win != ' ')
+            result.score = win == 'D' ? 0 : -(SCORE_WIN + N_GRIDS - s->n_marks);
         return result;
     }
-    zobrist_entry_t *entry = zobrist_get(hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
+    if (!(++s->n_nodes % CLOCK_CHECK_NODES) && check_deadline &&
+        past_deadline())
+        __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+    if (stopped())
+        return (move_t){0, -1};
+
+    /* A stored score is usable if it was searched at least as deep and,
+     * for a bound, if it still decides the window.
+     */
+    int sym;
+    uint64_t key = canonical_key(s, &sym);
+    zobrist_entry_t entry;
+    bool found = zobrist_get(key, &entry);
+    /* Stored moves are seen through the symmetry of the canonical key */
+    int stored_move =
+        found && entry.move >= 0 ? symmetry_inverse[sym][entry.move] : -1;
+    int first_move = last_move < 0 ? s->root_best_move : stored_move;
+    if (found && entry.depth >= depth) {
+        move_t stored = {.score = entry.score, .move = stored_move};
+        if (entry.bound == ZOBRIST_EXACT)
+            return stored;
+        if (entry.bound == ZOBRIST_LOWER && stored.score > alpha)
+            alpha = stored.score;
+        else if (entry.bound == ZOBRIST_UPPER && stored.score < beta)
+            beta = stored.score;
+        if (alpha >= beta)
+            return stored;
+    }
+    /* The bound type of the result refers to the window actually searched */
+    int alpha_orig = alpha;
 
     int score;
-    move_t best_move = {-10000, -1};
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-    qsort(moves, n_moves, sizeof(int), cmp_moves);
+    move_t best_move = {-SCORE_INF, -1};
+    int moves[MAX_GRIDS];
+    int n_moves = order_moves(s, first_move, moves);
     for (int i = 0; i < n_moves; i++) {
-        table[moves[i]] = player;
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
+        s->boards[PLAYER_INDEX(player)] |= GRID_BIT(moves[i]);
+        s->n_marks++;
+        eval_update(&s->eval, moves[i], PLAYER_INDEX(player), 1);
+        toggle_mark(s, moves[i], PLAYER_INDEX(player));
         if (!i)  // do a full search on the first move
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X', -beta,
-                             -alpha)
+            score = -negamax(s, depth - 1, player == 'X' ? 'O' : 'X', -beta,
+                             -alpha, moves[i])
                          .score;
         else {
             // do a null-window search on the rest of the moves
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
-                             -alpha - 1, -alpha)
+            score = -negamax(s, depth - 1, player == 'X' ? 'O' : 'X',
+                             -alpha - 1, -alpha, moves[i])
                          .score;
             if (alpha < score && score < beta)  // do a full re-search
-                score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
-                                 -beta, -score)
+                score = -negamax(s, depth - 1, player == 'X' ? 'O' : 'X',
+                                 -beta, -score, moves[i])
                              .score;
         }
-        history_count[moves[i]]++;
-        history_score_sum[moves[i]] += score;
+        s->history_count[moves[i]]++;
+        s->history_score_sum[moves[i]] += score;
+        s->history_mean[moves[i]] =
+            s->history_score_sum[moves[i]] / s->history_count[moves[i]];
         if (score > best_move.score) {
             best_move.score = score;
             best_move.move = moves[i];
         }
-        table[moves[i]] = ' ';
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
+        s->boards[PLAYER_INDEX(player)] &= ~GRID_BIT(moves[i]);
+        s->n_marks--;
+        eval_update(&s->eval, moves[i], PLAYER_INDEX(player), -1);
+        toggle_mark(s, moves[i], PLAYER_INDEX(player));
+        if (stopped())
+            break;
         if (score > alpha)
             alpha = score;
-        if (alpha >= beta)
+        if (alpha >= beta) {
+            add_killer(s, moves[i]);
             break;
+        }
     }
 
-    free((char *) moves);
-    zobrist_put(hash_value, best_move.score, best_move.move);
+    if (stopped())
+        return best_move;
+    int bound = best_move.score <= alpha_orig ? ZOBRIST_UPPER
+                : best_move.score >= beta     ? ZOBRIST_LOWER
+                                              : ZOBRIST_EXACT;
+    zobrist_put(key, best_move.score,
+                best_move.move >= 0 ? symmetry_grids[sym][best_move.move] : -1,
+                depth, bound);
     return best_move;
 }
 
+/* Deepen from s->first_depth to s->max_depth. Each iteration first tries a
+ * narrow window around the previous score and widens it on failure.
+ */
+static void *deepen(void *arg)
+{
+    struct search_state *s = arg;
+    move_t result = s->result;
+    for (int depth = s->first_depth; depth <= s->max_depth; depth++) {
+        int alpha = -SCORE_INF, beta = SCORE_INF;
+        if (s->depth_done) {
+            alpha = result.score - ASPIRATION_WINDOW;
+            beta = result.score + ASPIRATION_WINDOW;
+        }
+        move_t current;
+        while (1) {
+            current = negamax(s, depth, s->player, alpha, beta, -1);
+            if (stopped() || (current.score > alpha && current.score < beta))
+                break;
+            if (current.score <= alpha)
+                alpha = -SCORE_INF;
+            else
+                beta = SCORE_INF;
+        }
+        if (stopped())
+            break;
+        result = current;
+        s->result = result;
+        s->depth_done = depth;
+        s->root_best_move = result.move;
+    }
+    return NULL;
+}
+
 void negamax_init()
 {
+    game_init();
     zobrist_init();
-    hash_value = 0;
+}
+
+/* Search depth 1, 2, ... up to MAX_SEARCH_DEPTH, or with a time budget or in
+ * exact mode up to the end of the game, and return the result of the deepest
+ * iteration that completed. Helper threads search the same position, half of
+ * them one ply deeper, and leave what they find in the shared transposition
+ * table.
+ */
+static move_t search_root(const char *table, char player, bool exact)
+{
+    static struct search_state states[NEGAMAX_MAX_THREADS];
+    int n_threads = negamax_threads < 1 ? 1
+                    : negamax_threads > NEGAMAX_MAX_THREADS
+                        ? NEGAMAX_MAX_THREADS
+                        : negamax_threads;
+
+    /* Entries carry their depth and bound, so deeper iterations can use
+     * those of shallower ones.
+     */
+    zobrist_clear();
+    zobrist_init_keys();
+    stop_search = false;
+    check_deadline = false;
+    solve_exact = exact;
+    int time_budget = exact ? 0 : negamax_time_budget;
+    int n_marks = 0;
+    for (int i = 0; i < N_GRIDS; i++)
+        n_marks += table[i] != ' ';
+    int max_depth = MAX_SEARCH_DEPTH;
+    if (exact || time_budget > 0)
+        max_depth = N_GRIDS - n_marks;
+    if (time_budget > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += time_budget / 1000;
+        deadline.tv_nsec += (time_budget % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        struct search_state *s = &states[i];
+        memset(s, 0, sizeof(*s));
+        table_to_bitboards(table, s->boards);
+        s->n_marks = s->root_marks = n_marks;
+        memset(s->killers, -1, sizeof(s->killers));
+        eval_init(&s->eval, s->boards);
+        s->n_keys = negamax_symmetry ? N_SYMMETRIES : 1;
+        for (int g = 0; g < N_GRIDS; g++) {
+            if (table[g] != ' ')
+                toggle_mark(s, g, PLAYER_INDEX(table[g]));
+        }
+        s->root_best_move = -1;
+        s->result = (move_t){0, -1};
+        s->player = player;
+        s->first_depth = 1 + (i & 1);
+        s->max_depth = max_depth;
+    }
+
+    /* Some answer is always ready: the main thread finishes depth 1 before
+     * anybody watches the clock.
+     */
+    states[0].max_depth = 1;
+    deepen(&states[0]);
+    check_deadline = time_budget > 0;
+    states[0].first_depth = 2;
+    states[0].max_depth = max_depth;
+
+    int n_started = 1;
+    for (; n_started < n_threads; n_started++) {
+        if (pthread_create(&states[n_started].thread, NULL, deepen,
+                           &states[n_started]))
+            break;
+    }
+    deepen(&states[0]);
+    /* The main thread is done; helpers stop at once */
+    __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+    for (int i = 1; i < n_started; i++)
+        pthread_join(states[i].thread, NULL);
+
+    const struct search_state *best = &states[0];
+    for (int i = 1; i < n_started; i++) {
+        if (states[i].depth_done > best->depth_done)
+            best = &states[i];
+    }
+    return best->result;
 }
 
 move_t negamax_predict(char *table, char player)
 {
-    memset(history_score_sum, 0, sizeof(history_score_sum));
-    memset(history_count, 0, sizeof(history_count));
-    move_t result;
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(table, depth, player, -100000, 100000);
-        zobrist_clear();
+    int result;
+    int move = book_move(table, player, &result);
+    if (move >= 0) {
+        move_t book = {result == BOOK_WIN    ? SCORE_WIN
+                       : result == BOOK_LOSS ? -SCORE_WIN
+                                             : 0,
+                       move};
+        return book;
     }
-    return result;
+    return search_root(table, player, false);
+}
+
+move_t negamax_solve(const char *table, char player)
+{
+    return search_root(table, player, true);
 }
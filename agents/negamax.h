@@ -4,5 +4,31 @@ typedef struct {
     int score, move;
 } move_t;
 
+/* Time budget of negamax_predict() in milliseconds. When positive, the
+ * search deepens until the budget is spent instead of stopping at a fixed
+ * depth.
+ */
+extern int negamax_time_budget;
+
+#define NEGAMAX_MAX_THREADS 64
+
+/* Number of search threads sharing the transposition table */
+extern int negamax_threads;
+
+/* Hash positions by the smallest of the Zobrist keys of their 8 rotations
+ * and reflections (nonzero), so that symmetric positions share entries.
+ */
+extern int negamax_symmetry;
+
 void negamax_init();
+
+/* Play the book move if a book is loaded and has the position, search
+ * otherwise.
+ */
 move_t negamax_predict(char *table, char player);
+
+/* Search to the end of the game, ignoring the time budget and the book. The
+ * score is 0 for a draw, positive for a win of player and negative for a
+ * loss, the further from 0 the sooner the game ends.
+ */
+move_t negamax_solve(const char *table, char player);
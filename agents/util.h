@@ -1,46 +1,53 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "game.h"
 
-static inline int eval_line_segment_score(const char *table,
-                                          char player,
-                                          int i,
-                                          int j,
-                                          line_t line)
+/* Static evaluation, maintained along the search. Every line segment scores
+ * 10^(n-1) for the player owning all of its n marks, and the opposite for
+ * the other player, so only the mark counts per segment matter. Placing or
+ * removing a mark changes the segments through its grid alone.
+ */
+typedef struct {
+    uint8_t counts[MAX_SEGMENTS][2]; /* Marks per segment, by PLAYER_INDEX */
+    int score;                       /* Sum of segment scores, for X */
+} eval_t;
+
+static inline int segment_score(const uint8_t counts[2])
+{
+    static const int powers[] = {0,     1,      10,      100,     1000,
+                                 10000, 100000, 1000000, 10000000};
+    _Static_assert(MAX_BOARD_SIZE < sizeof(powers) / sizeof(powers[0]),
+                   "Segment scores must be tabulated up to GOAL marks");
+    if (counts[0] && counts[1])
+        return 0;
+    return powers[counts[1]] - powers[counts[0]];
+}
+
+static inline void eval_init(eval_t *e, const bitboard_t boards[2])
 {
-    int score = 0;
-    for (int k = 0; k < GOAL; k++) {
-        char curr =
-            table[GET_INDEX(i + k * line.i_shift, j + k * line.j_shift)];
-        if (curr == player) {
-            if (score < 0)
-                return 0;
-            if (score)
-                score *= 10;
-            else
-                score = 1;
-        } else if (curr != ' ') {
-            if (score > 0)
-                return 0;
-            if (score)
-                score *= 10;
-            else
-                score = -1;
-        }
+    e->score = 0;
+    for (int s = 0; s < N_SEGMENTS; s++) {
+        for (int p = 0; p < 2; p++)
+            e->counts[s][p] =
+                __builtin_popcountll(boards[p] & segment_masks[s]);
+        e->score += segment_score(e->counts[s]);
     }
-    return score;
 }
 
-static inline int get_score(const char *table, char player)
+/* Account for a mark of PLAYER_INDEX p placed (delta 1) or removed (-1) */
+static inline void eval_update(eval_t *e, int move, int p, int delta)
 {
-    int score = 0;
-    for (int i_line = 0; i_line < 4; ++i_line) {
-        line_t line = lines[i_line];
-        for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
-            for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
-                score += eval_line_segment_score(table, player, i, j, line);
-            }
-        }
+    for (int k = 0; k < n_grid_segments[move]; k++) {
+        uint8_t *counts = e->counts[grid_segments[move][k]];
+        e->score -= segment_score(counts);
+        counts[p] += delta;
+        e->score += segment_score(counts);
     }
-    return score;
+}
+
+static inline int eval_score(const eval_t *e, char player)
+{
+    return player == 'X' ? e->score : -e->score;
 }
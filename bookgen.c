@@ -0,0 +1,170 @@
+/* Build an opening and endgame book for the tic-tac-toe agents: solve every
+ * position with at most a few marks or at most a few empty grids to the end
+ * of the game, and write the results with book_save().
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agents/book.h"
+#include "agents/negamax.h"
+#include "game.h"
+#include "zobrist.h"
+
+struct position {
+    uint64_t key;
+    char table[MAX_GRIDS];
+};
+
+static struct position *positions;
+static size_t n_positions, positions_cap;
+
+static void add_position(const char *table)
+{
+    if (check_win((char *) table) != ' ')
+        return;
+    if (n_positions == positions_cap) {
+        positions_cap = positions_cap ? positions_cap * 2 : 1024;
+        positions = realloc(positions, positions_cap * sizeof(*positions));
+        if (!positions) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    struct position *p = &positions[n_positions++];
+    int sym;
+    p->key = book_key(table, &sym);
+    memcpy(p->table, table, N_GRIDS);
+}
+
+/* Place n_x crosses and n_o noughts on grids from grid onwards in every way */
+static void enumerate(char *table, int grid, int n_x, int n_o)
+{
+    if (n_x + n_o > N_GRIDS - grid)
+        return;
+    if (grid == N_GRIDS) {
+        add_position(table);
+        return;
+    }
+    if (n_x) {
+        table[grid] = 'X';
+        enumerate(table, grid + 1, n_x - 1, n_o);
+    }
+    if (n_o) {
+        table[grid] = 'O';
+        enumerate(table, grid + 1, n_x, n_o - 1);
+    }
+    table[grid] = ' ';
+    enumerate(table, grid + 1, n_x, n_o);
+}
+
+static int cmp_positions(const void *a, const void *b)
+{
+    uint64_t x = ((const struct position *) a)->key;
+    uint64_t y = ((const struct position *) b)->key;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-o FILE][-d DEPTH][-e EMPTY][-t THREADS]"
+           "[-s SIZE][-g GOAL][-x]\n",
+           cmd);
+    printf("\t-h          Print this information\n");
+    printf("\t-o FILE     Write the book to FILE (default book.bin)\n");
+    printf("\t-d DEPTH    Solve positions with up to DEPTH marks "
+           "(default 4)\n");
+    printf("\t-e EMPTY    Solve positions with up to EMPTY empty grids "
+           "(default 4)\n");
+    printf("\t-t THREADS  Search with THREADS threads (default 1)\n");
+    printf("\t-s SIZE     Play on a SIZE by SIZE board (default %d)\n",
+           DEFAULT_BOARD_SIZE);
+    printf("\t-g GOAL     Win with GOAL marks in a row (default %d)\n",
+           DEFAULT_GOAL);
+    printf("\t-x          Win with exactly GOAL marks in a row only\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "book.bin";
+    int depth = 4, max_empty = 4;
+    int c;
+    while ((c = getopt(argc, argv, "ho:d:e:t:s:g:x")) != -1) {
+        switch (c) {
+        case 'o':
+            path = optarg;
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'e':
+            max_empty = atoi(optarg);
+            break;
+        case 't':
+            negamax_threads = atoi(optarg);
+            break;
+        case 's':
+            game_board_size = atoi(optarg);
+            break;
+        case 'g':
+            game_goal = atoi(optarg);
+            break;
+        case 'x':
+            game_allow_exceed = 0;
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    const char *error = game_options_error();
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    negamax_init();
+    char table[MAX_GRIDS];
+    for (int n_marks = 0; n_marks < N_GRIDS; n_marks++) {
+        if (n_marks <= depth || N_GRIDS - n_marks <= max_empty)
+            enumerate(table, 0, (n_marks + 1) / 2, n_marks / 2);
+    }
+
+    /* Symmetric positions share their key; solve one of each */
+    qsort(positions, n_positions, sizeof(*positions), cmp_positions);
+    book_entry_t *entries = malloc((n_positions + 1) * sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t n_entries = 0;
+    for (size_t i = 0; i < n_positions; i++) {
+        if (i && positions[i].key == positions[i - 1].key)
+            continue;
+        int n_marks = 0;
+        for (int g = 0; g < N_GRIDS; g++)
+            n_marks += positions[i].table[g] != ' ';
+        char player = n_marks & 1 ? 'O' : 'X';
+        move_t best = negamax_solve(positions[i].table, player);
+        if (best.move < 0)
+            continue;
+        int sym;
+        book_entry_t *e = &entries[n_entries++];
+        e->key = book_key(positions[i].table, &sym);
+        e->move = symmetry_grids[sym][best.move];
+        e->result = best.score > 0   ? BOOK_WIN
+                    : best.score < 0 ? BOOK_LOSS
+                                     : BOOK_DRAW;
+    }
+    free(positions);
+
+    if (!book_save(path, entries, n_entries)) {
+        perror(path);
+        return 1;
+    }
+    printf("Wrote %zu positions to %s\n", n_entries, path);
+    free(entries);
+    return 0;
+}
@@ -12,12 +12,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "agents/book.h"
 #include "agents/mcts.h"
 #include "agents/negamax.h"
 #include "console.h"
 #include "corottt.h"
+#include "game.h"
 #include "report.h"
+#include "tournament.h"
 #include "web.h"
+#include "zobrist.h"
 
 /* Some global values */
 int simulation = 0;
@@ -429,6 +433,66 @@ static bool do_ttt(int argc, char *argv[])
     return 0;
 }
 
+static bool do_book(int argc, char *argv[])
+{
+    if (argc < 2) {
+        book_unload();
+        return true;
+    }
+    if (!book_load(argv[1])) {
+        report(1, "Cannot load book '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_tournament(int argc, char *argv[])
+{
+    if (argc < 4) {
+        report(1, "%s needs a number of games and two agents or more",
+               argv[0]);
+        return false;
+    }
+    int n_games;
+    if (!get_int(argv[1], &n_games)) {
+        report(1, "Cannot parse '%s' as a number of games", argv[1]);
+        return false;
+    }
+    return tournament(n_games, argc - 2, argv + 2);
+}
+
+/* Rebuild the game tables for new board options, or report why they are
+ * not playable and tell the caller to restore the old value.
+ */
+static bool game_options_changed(void)
+{
+    const char *error = game_options_error();
+    if (error) {
+        report(1, "%s", error);
+        return false;
+    }
+    game_init();
+    return true;
+}
+
+static void board_size_changed(int oldval)
+{
+    if (!game_options_changed())
+        game_board_size = oldval;
+}
+
+static void goal_changed(int oldval)
+{
+    if (!game_options_changed())
+        game_goal = oldval;
+}
+
+static void allow_exceed_changed(int oldval)
+{
+    if (!game_options_changed())
+        game_allow_exceed = oldval;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
@@ -447,6 +511,11 @@ void init_cmd()
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     ADD_COMMAND(ttt, "Start ttt Game", "[port]");
+    ADD_COMMAND(book, "Play from book built by bookgen, none without file",
+                "[file]");
+    ADD_COMMAND(tournament,
+                "Play games between every two agents without rendering",
+                "games agent agent ...");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
@@ -454,6 +523,36 @@ void init_cmd()
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
     add_param("CvC", &cvc, "Active Computer vs. Computer mode", NULL);
+    add_param("mcts_threads", &mcts_threads, "Number of MCTS search threads",
+              NULL);
+    add_param("mcts_tree", &mcts_tree_parallel,
+              "Share one MCTS tree among threads instead of one tree each",
+              NULL);
+    add_param("mcts_dag", &mcts_transpositions,
+              "Share MCTS statistics among transposed positions", NULL);
+    add_param("mcts_rave", &mcts_rave,
+              "MCTS RAVE equivalence parameter (0: plain UCT)", NULL);
+    add_param("mcts_time", &mcts_time_budget,
+              "MCTS time budget per move in ms (0: fixed iterations)", NULL);
+    add_param("negamax_time", &negamax_time_budget,
+              "Negamax time budget per move in ms (0: fixed depth)", NULL);
+    add_param("negamax_threads", &negamax_threads,
+              "Number of negamax search threads", NULL);
+    add_param("negamax_symmetry", &negamax_symmetry,
+              "Share negamax table entries among symmetric positions", NULL);
+    add_param("tt_size", &zobrist_size_mb,
+              "Negamax transposition table size in MiB", zobrist_resize);
+    add_param("tt_policy", &zobrist_policy,
+              "TT replacement (0: depth-preferred, 1: always)", NULL);
+    add_param("board_size", &game_board_size, "Width and height of the board",
+              board_size_changed);
+    add_param("goal", &game_goal, "Marks in a row needed to win", goal_changed);
+    add_param("allow_exceed", &game_allow_exceed,
+              "Whether lines longer than goal win", allow_exceed_changed);
+    add_param("tournament_workers", &tournament_workers,
+              "Tournament worker processes (0: one per CPU)", NULL);
+    add_param("tournament_opening", &tournament_opening,
+              "Random plies opening every tournament game", NULL);
     init_in();
     init_time(&last_time);
     first_time = last_time;
@@ -20,7 +20,7 @@ void display_current_time()
     fflush(stdout);
 }
 
-static int move_record[N_GRIDS];
+static int move_record[MAX_GRIDS];
 static int move_count = 0;
 
 static void record_move(int move)
@@ -235,7 +235,8 @@ void task1(void *arg)
 void ttt_coro(int cvc)
 {
     srand(time(NULL));
-    char table[N_GRIDS];
+    game_init();
+    char table[MAX_GRIDS];
     memset(table, ' ', N_GRIDS);
 
     if (cvc) {
@@ -1,65 +1,184 @@
 #include <assert.h>
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "game.h"
 
-#define LOOKUP(table, i, j, else_value)                         \
-    ((i) < 0 || (j) < 0 || (i) > BOARD_SIZE || (j) > BOARD_SIZE \
-         ? (else_value)                                         \
-         : (table)[GET_INDEX(i, j)])
-
-_Static_assert(BOARD_SIZE <= 26, "Board size must not be greater than 26");
-_Static_assert(BOARD_SIZE > 0, "Board size must be greater than 0");
-_Static_assert(GOAL <= BOARD_SIZE, "Goal must not be greater than board size");
-_Static_assert(GOAL > 0, "Goal must be greater than 0");
-_Static_assert(ALLOW_EXCEED == 0 || ALLOW_EXCEED == 1,
-               "ALLOW_EXCEED must be a boolean that is 0 or 1");
-
-const line_t lines[4] = {
-    {1, 0, 0, 0, BOARD_SIZE - GOAL + 1, BOARD_SIZE},             // ROW
-    {0, 1, 0, 0, BOARD_SIZE, BOARD_SIZE - GOAL + 1},             // COL
-    {1, 1, 0, 0, BOARD_SIZE - GOAL + 1, BOARD_SIZE - GOAL + 1},  // PRIMARY
-    {1, -1, 0, GOAL - 1, BOARD_SIZE - GOAL + 1, BOARD_SIZE},     // SECONDARY
-};
+_Static_assert(MAX_GRIDS <= 64, "Board must fit in a 64-bit bitboard");
+_Static_assert(MAX_BOARD_SIZE <= 26, "Board size must not be greater than 26");
+
+int game_board_size = DEFAULT_BOARD_SIZE;
+int game_goal = DEFAULT_GOAL;
+int game_allow_exceed = DEFAULT_ALLOW_EXCEED;
+
+line_t lines[4];
+bitboard_t board_mask;
+
+bitboard_t segment_masks[MAX_SEGMENTS];
+bitboard_t segment_ends[MAX_SEGMENTS];
+int grid_segments[MAX_GRIDS][MAX_GRID_SEGMENTS];
+int n_grid_segments[MAX_GRIDS];
+direction_t directions[4];
+bool (*has_line)(bitboard_t b);
+unsigned game_generation;
+
+static bool on_board(int i, int j)
+{
+    return i >= 0 && j >= 0 && i < BOARD_SIZE && j < BOARD_SIZE;
+}
 
-static char check_line_segment_win(const char *t, int i, int j, line_t line)
+/* Shared body of the line kernels, with steps[d] == directions[d].step */
+static inline __attribute__((always_inline)) bool find_line(
+    bitboard_t b,
+    const int steps[4],
+    int goal)
 {
-    char last = t[GET_INDEX(i, j)];
-    if (last == ' ')
-        return ' ';
-    for (int k = 1; k < GOAL; k++) {
-        if (last != t[GET_INDEX(i + k * line.i_shift, j + k * line.j_shift)]) {
-            return ' ';
+    for (int d = 0; d < 4; d++) {
+        bitboard_t runs = b & directions[d].starts;
+        for (int k = 1; k < goal; k++)
+            runs &= b >> (k * steps[d]);
+        if (runs && !ALLOW_EXCEED) {
+            /* Drop the runs that go on past either end */
+            runs &= ~(b << steps[d] & directions[d].has_before);
+            if (goal * steps[d] < 64)
+                runs &= ~(b >> (goal * steps[d]) & directions[d].has_after);
         }
+        if (runs)
+            return true;
     }
-#if !ALLOW_EXCEED
-    if (last == LOOKUP(t, i - line.i_shift, j - line.j_shift, ' ') ||
-        last ==
-            LOOKUP(t, i + GOAL * line.i_shift, j + GOAL * line.j_shift, ' '))
-        return ' ';
-#endif
-    return last;
+    return false;
 }
 
-char check_win(char *t)
+static int generic_steps[4];
+
+static bool has_line_generic(bitboard_t b)
+{
+    return find_line(b, generic_steps, GOAL);
+}
+
+/* Kernels with the steps of an n by n board and the goal as constants */
+#define LINE_KERNEL(n, goal)                                    \
+    static bool has_line_##n##_##goal(bitboard_t b)             \
+    {                                                           \
+        static const int steps[4] = {n, 1, n + 1, n - 1};       \
+        return find_line(b, steps, goal);                       \
+    }
+
+LINE_KERNEL(3, 3)
+LINE_KERNEL(4, 3)
+LINE_KERNEL(4, 4)
+LINE_KERNEL(5, 3)
+LINE_KERNEL(5, 4)
+LINE_KERNEL(5, 5)
+LINE_KERNEL(6, 4)
+LINE_KERNEL(6, 5)
+LINE_KERNEL(6, 6)
+LINE_KERNEL(7, 4)
+LINE_KERNEL(7, 5)
+LINE_KERNEL(8, 5)
+
+static bool (*const line_kernels[MAX_BOARD_SIZE + 1][MAX_BOARD_SIZE + 1])(
+    bitboard_t) = {
+    [3][3] = has_line_3_3, [4][3] = has_line_4_3, [4][4] = has_line_4_4,
+    [5][3] = has_line_5_3, [5][4] = has_line_5_4, [5][5] = has_line_5_5,
+    [6][4] = has_line_6_4, [6][5] = has_line_6_5, [6][6] = has_line_6_6,
+    [7][4] = has_line_7_4, [7][5] = has_line_7_5, [8][5] = has_line_8_5,
+};
+
+void game_init(void)
 {
+    const int n = BOARD_SIZE - GOAL + 1;
+    lines[0] = (line_t){1, 0, 0, 0, n, BOARD_SIZE};            // ROW
+    lines[1] = (line_t){0, 1, 0, 0, BOARD_SIZE, n};            // COL
+    lines[2] = (line_t){1, 1, 0, 0, n, n};                     // PRIMARY
+    lines[3] = (line_t){1, -1, 0, GOAL - 1, n, BOARD_SIZE};    // SECONDARY
+    board_mask =
+        N_GRIDS == 64 ? ~(bitboard_t) 0 : GRID_BIT(N_GRIDS % 64) - 1;
+
+    int s = 0;
     for (int i_line = 0; i_line < 4; ++i_line) {
         line_t line = lines[i_line];
+        direction_t *dir = &directions[i_line];
+        dir->step = line.i_shift * BOARD_SIZE + line.j_shift;
+        dir->starts = dir->has_before = dir->has_after = 0;
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            for (int j = 0; j < BOARD_SIZE; j++) {
+                if (on_board(i - line.i_shift, j - line.j_shift))
+                    dir->has_before |= GRID_BIT(GET_INDEX(i, j));
+            }
+        }
         for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
             for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
-                char win = check_line_segment_win(t, i, j, line);
-                if (win != ' ')
-                    return win;
+                bitboard_t mask = 0;
+                for (int k = 0; k < GOAL; k++)
+                    mask |= GRID_BIT(
+                        GET_INDEX(i + k * line.i_shift, j + k * line.j_shift));
+                bitboard_t ends = 0;
+                if (on_board(i - line.i_shift, j - line.j_shift))
+                    ends |= GRID_BIT(
+                        GET_INDEX(i - line.i_shift, j - line.j_shift));
+                dir->starts |= GRID_BIT(GET_INDEX(i, j));
+                if (on_board(i + GOAL * line.i_shift,
+                             j + GOAL * line.j_shift)) {
+                    dir->has_after |= GRID_BIT(GET_INDEX(i, j));
+                    ends |= GRID_BIT(GET_INDEX(i + GOAL * line.i_shift,
+                                               j + GOAL * line.j_shift));
+                }
+                segment_masks[s] = mask;
+                segment_ends[s] = ends;
+                s++;
             }
         }
+        generic_steps[i_line] = dir->step;
     }
-    for (int i = 0; i < N_GRIDS; i++)
-        if (t[i] == ' ')
-            return ' ';
-    return 'D';
+    assert(s == N_SEGMENTS);
+
+    memset(n_grid_segments, 0, sizeof(n_grid_segments));
+    for (s = 0; s < N_SEGMENTS; s++) {
+        bitboard_t cells = segment_masks[s];
+        while (cells) {
+            int i = bitboard_pop(&cells);
+            grid_segments[i][n_grid_segments[i]++] = s;
+        }
+    }
+
+    has_line = line_kernels[BOARD_SIZE][GOAL] ? line_kernels[BOARD_SIZE][GOAL]
+                                              : has_line_generic;
+    game_generation++;
+}
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+const char *game_options_error(void)
+{
+    if (BOARD_SIZE < 1 || BOARD_SIZE > MAX_BOARD_SIZE)
+        return "Board size must be from 1 to " TO_STRING(MAX_BOARD_SIZE);
+    if (GOAL < 1 || GOAL > BOARD_SIZE)
+        return "Goal must be from 1 to the board size";
+    if (ALLOW_EXCEED != 0 && ALLOW_EXCEED != 1)
+        return "allow_exceed must be 0 or 1";
+    return NULL;
+}
+
+void table_to_bitboards(const char *t, bitboard_t boards[2])
+{
+    boards[0] = boards[1] = 0;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (t[i] == 'O')
+            boards[0] |= GRID_BIT(i);
+        else if (t[i] == 'X')
+            boards[1] |= GRID_BIT(i);
+    }
+}
+
+char check_win(char *t)
+{
+    bitboard_t boards[2];
+    table_to_bitboards(t, boards);
+    return check_win_bitboards(boards);
 }
 
 unsigned long calculate_win_value(char win, char player)
@@ -71,18 +190,6 @@ unsigned long calculate_win_value(char win, char player)
     return (1U << (FIXED_SCALE_BITS - 1));
 }
 
-int *available_moves(const char *table)
-{
-    int *moves = malloc(N_GRIDS * sizeof(int));
-    int m = 0;
-    for (int i = 0; i < N_GRIDS; i++)
-        if (table[i] == ' ')
-            moves[m++] = i;
-    if (m < N_GRIDS)
-        moves[m] = -1;
-    return moves;
-}
-
 void draw_board(const char *t)
 {
     for (int i = 0; i < BOARD_SIZE; i++) {
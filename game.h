@@ -1,8 +1,27 @@
 #pragma once
 
-#define BOARD_SIZE 4
-#define GOAL 3
-#define ALLOW_EXCEED 1
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The board is configured at run time, within these limits. Arrays indexed
+ * by grid or segment are sized for the largest board.
+ */
+#define MAX_BOARD_SIZE 8
+#define MAX_GRIDS (MAX_BOARD_SIZE * MAX_BOARD_SIZE)
+#define MAX_SEGMENTS (4 * MAX_GRIDS)
+
+#define DEFAULT_BOARD_SIZE 4
+#define DEFAULT_GOAL 3
+#define DEFAULT_ALLOW_EXCEED 1
+
+/* Options; game_init() must run again after any of them changes */
+extern int game_board_size;
+extern int game_goal;
+extern int game_allow_exceed; /* Whether lines longer than GOAL win */
+
+#define BOARD_SIZE game_board_size
+#define GOAL game_goal
+#define ALLOW_EXCEED game_allow_exceed
 #define N_GRIDS (BOARD_SIZE * BOARD_SIZE)
 #define GET_INDEX(i, j) ((i) * (BOARD_SIZE) + (j))
 #define GET_COL(x) ((x) % BOARD_SIZE)
@@ -12,6 +31,29 @@
     for (int i = 0; i < N_GRIDS; i++) \
         if (table[i] == ' ')
 
+/* Number of GOAL-length line segments on the board, at most MAX_SEGMENTS */
+#define N_SEGMENTS                                                    \
+    (2 * BOARD_SIZE * (BOARD_SIZE - GOAL + 1) +                       \
+     2 * (BOARD_SIZE - GOAL + 1) * (BOARD_SIZE - GOAL + 1))
+
+/* Bitboard of one player: bit i is set when grid i holds its mark */
+typedef uint64_t bitboard_t;
+
+#define GRID_BIT(i) ((bitboard_t) 1 << (i))
+#define BOARD_MASK board_mask
+extern bitboard_t board_mask;
+
+/* Index of a player's bitboard, matching the layout of zobrist_table */
+#define PLAYER_INDEX(player) ((player) == 'X')
+
+/* Return index of lowest set bit in *b and clear it; *b must be nonzero */
+static inline int bitboard_pop(bitboard_t *b)
+{
+    int i = __builtin_ctzll(*b);
+    *b &= *b - 1;
+    return i;
+}
+
 typedef struct {
     int i_shift, j_shift;
     int i_lower_bound, j_lower_bound, i_upper_bound, j_upper_bound;
@@ -21,9 +63,82 @@ typedef struct {
  * starting from lsb */
 #define FIXED_SCALE_BITS 15
 
-extern const line_t lines[4];
+/* Segments of GOAL grids in each direction, for the current board */
+extern line_t lines[4];
+
+/* Cells of every line segment */
+extern bitboard_t segment_masks[MAX_SEGMENTS];
+
+/* Cells just before and just after every line segment, if on the board */
+extern bitboard_t segment_ends[MAX_SEGMENTS];
+
+/* Line segments passing through each grid, as indices in segment_masks */
+#define MAX_GRID_SEGMENTS (4 * MAX_BOARD_SIZE)
+extern int grid_segments[MAX_GRIDS][MAX_GRID_SEGMENTS];
+extern int n_grid_segments[MAX_GRIDS];
+
+/* Lines are found a direction at a time on a whole bitboard: a segment
+ * starts at each marked grid whose GOAL - 1 next neighbours in the
+ * direction are marked too. Directions are in the order of lines[].
+ */
+typedef struct {
+    int step;              /* Index difference between neighbouring grids */
+    bitboard_t starts;     /* Grids starting a segment */
+    bitboard_t has_before; /* Grids with a neighbour before them */
+    bitboard_t has_after;  /* Starts of segments with a grid past their end */
+} direction_t;
+extern direction_t directions[4];
+
+/* Return true if b holds a winning line. game_init() points this to a
+ * kernel compiled for the board size, if there is one.
+ */
+extern bool (*has_line)(bitboard_t b);
+
+/* Incremented by every game_init(), so that agents can drop what they keep
+ * between searches when the board may have changed.
+ */
+extern unsigned game_generation;
+
+/* Build lookup tables for the current options. Must be called before any
+ * other function here.
+ */
+void game_init(void);
+
+/* Return NULL if the board options describe a playable board, or else the
+ * reason why they do not.
+ */
+const char *game_options_error(void);
 
-int *available_moves(const char *table);
 char check_win(char *t);
+void table_to_bitboards(const char *t, bitboard_t boards[2]);
+
+/* Return 'O' or 'X' for a win, 'D' for a draw, ' ' if the game goes on */
+static inline char check_win_bitboards(const bitboard_t boards[2])
+{
+    for (int p = 0; p < 2; p++) {
+        if (has_line(boards[p]))
+            return p ? 'X' : 'O';
+    }
+    return (boards[0] | boards[1]) == BOARD_MASK ? 'D' : ' ';
+}
+
+/* Like check_win_bitboards, when the last mark placed is at grid move and
+ * n_marks grids are taken. Only a line through move can be new, so only the
+ * segments through it are tested, against the board of its owner.
+ */
+static inline char check_win_after_bitboards(const bitboard_t boards[2],
+                                             int move,
+                                             int n_marks)
+{
+    int p = !!(boards[1] & GRID_BIT(move));
+    bitboard_t b = boards[p];
+    for (int k = 0; k < n_grid_segments[move]; k++) {
+        int s = grid_segments[move][k];
+        if ((b & segment_masks[s]) == segment_masks[s] &&
+            (ALLOW_EXCEED || !(b & segment_ends[s])))
+            return p ? 'X' : 'O';
+    }
+    return n_marks == N_GRIDS ? 'D' : ' ';
+}
 unsigned long calculate_win_value(char win, char player);
 void draw_board(const char *t);
\ No newline at end of file
@@ -1,10 +1,18 @@
 /* Test support code */
 
+/* dladdr is a GNU extension */
+#if defined(__linux__) || defined(__GNU__)
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -29,24 +37,64 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Every block starts with this header */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/* Addresses of live blocks are kept in an open-addressing hash set (linear
+ * probing, power-of-two capacity) so that cautious mode can validate a block
+ * in O(1).
+ */
+#define LIVE_SET_MIN_CAPACITY 1024
+
+static block_element_t **live_set = NULL;
+static size_t live_capacity = 0;
+
+/* Number of allocations and frees per payload size class */
+static size_t alloc_hist[N_SIZE_CLASSES];
+static size_t free_hist[N_SIZE_CLASSES];
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Deterministic fault injection rules. A zero field disables that rule. */
+static struct {
+    bool armed;    /* Any rule besides fail_probability active */
+    size_t seq;    /* Allocations seen since the schedule was armed */
+    size_t nth;    /* Fail allocation number nth */
+    size_t every;  /* Fail every allocation whose number is a multiple */
+    size_t above;  /* Fail allocations larger than this */
+    void *site_fn; /* Fail allocations called from this function */
+    char site_name[64];
+    void *last_site; /* Cached result of the last call site lookup */
+    bool last_match;
+    bool seeded;  /* Generator state set, either by fault_seed or lazily */
+    uint64_t rng; /* State of the generator behind fail_probability */
+} fault;
+
+/* Aggregate allocations per call site when nonzero */
+int alloc_profile = 0;
+
+/* Per call site statistics, kept in a fixed open-addressing table */
+#define ALLOC_SITE_SLOTS 1024
+
+typedef struct {
+    void *site; /* Return address of the test_* call */
+    size_t allocs, alloc_bytes;
+    size_t frees, free_bytes;
+    uint64_t nsecs; /* Time spent inside the harness */
+} alloc_site_t;
+
+static alloc_site_t alloc_sites[ALLOC_SITE_SLOTS];
+
 static bool cautious_mode = true;
+static int harness_level = HARNESS_FULL;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
@@ -60,13 +108,162 @@ static bool time_limited = false;
 
 /* Internal functions */
 
+/* Next value of the fault injection generator (splitmix64) */
+static uint64_t fault_random()
+{
+    if (!fault.seeded) {
+        fault.rng = (uint64_t) random() << 31 ^ (uint64_t) random();
+        fault.seeded = true;
+    }
+    uint64_t z = (fault.rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Does the call site lie within the function selected by fault_fail_site? */
+static bool fault_site_match(void *site)
+{
+    if (site != fault.last_site) {
+        Dl_info info;
+        fault.last_site = site;
+        fault.last_match =
+            dladdr(site, &info) && info.dli_saddr == fault.site_fn;
+    }
+    return fault.last_match;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static bool fail_allocation(size_t size, void *site)
 {
-    double weight = (double) random() / RAND_MAX;
+    if (!fault.armed && !fail_probability)
+        return false;
+
+    size_t seq = ++fault.seq;
+    if (fault.nth && seq == fault.nth)
+        return true;
+    if (fault.every && seq % fault.every == 0)
+        return true;
+    if (fault.above && size > fault.above)
+        return true;
+    if (fault.site_fn && fault_site_match(site))
+        return true;
+
+    if (!fail_probability)
+        return false;
+    double weight = (double) (fault_random() >> 11) / (1ULL << 53);
     return (weight < 0.01 * fail_probability);
 }
 
+static inline size_t live_slot(const block_element_t *b)
+{
+    /* Low bits of block addresses are always zero. Keep address order, so
+     * that blocks allocated one after another land in nearby slots.
+     */
+    return ((uintptr_t) b >> 4) & (live_capacity - 1);
+}
+
+/* Move the live set to a table of capacity slots. Keep the old table and
+ * return false if the new one cannot be allocated.
+ */
+static bool live_set_resize(size_t capacity)
+{
+    block_element_t **old_set = live_set;
+    size_t old_capacity = live_capacity;
+
+    block_element_t **new_set = calloc(capacity, sizeof(block_element_t *));
+    if (!new_set)
+        return false;
+    live_set = new_set;
+    live_capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        block_element_t *b = old_set[i];
+        if (!b)
+            continue;
+        size_t slot = live_slot(b);
+        while (live_set[slot])
+            slot = (slot + 1) & (live_capacity - 1);
+        live_set[slot] = b;
+    }
+    free(old_set);
+    return true;
+}
+
+/* Make room for one more block, keeping the load factor at most 1/2 */
+static bool live_set_reserve(void)
+{
+    if (2 * (allocated_count + 1) <= live_capacity)
+        return true;
+    return live_set_resize(live_capacity ? 2 * live_capacity
+                                         : LIVE_SET_MIN_CAPACITY);
+}
+
+/* Add b, for which live_set_reserve() made room */
+static void live_set_insert(block_element_t *b)
+{
+    size_t slot = live_slot(b);
+    while (live_set[slot])
+        slot = (slot + 1) & (live_capacity - 1);
+    live_set[slot] = b;
+}
+
+/* Return slot holding block b, or live_capacity if absent */
+static size_t live_set_find(const block_element_t *b)
+{
+    if (!live_capacity)
+        return live_capacity;
+
+    size_t slot = live_slot(b);
+    while (live_set[slot]) {
+        if (live_set[slot] == b)
+            return slot;
+        slot = (slot + 1) & (live_capacity - 1);
+    }
+    return live_capacity;
+}
+
+static void live_set_remove(const block_element_t *b)
+{
+    size_t hole = live_set_find(b);
+    if (hole == live_capacity)
+        return;
+
+    /* Backward-shift deletion keeps probe sequences intact without
+     * tombstones.
+     */
+    size_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & (live_capacity - 1);
+        block_element_t *e = live_set[slot];
+        if (!e)
+            break;
+        size_t home = live_slot(e);
+        /* Move e into the hole unless its home lies cyclically in
+         * (hole, slot]
+         */
+        if (((slot - home) & (live_capacity - 1)) >=
+            ((slot - hole) & (live_capacity - 1))) {
+            live_set[hole] = e;
+            hole = slot;
+        }
+    }
+    live_set[hole] = NULL;
+}
+
+/* Size class k >= 1 holds payloads in (SIZE_CLASS_MIN << (k - 1),
+ * SIZE_CLASS_MIN << k]; class 0 holds everything up to SIZE_CLASS_MIN and the
+ * last class everything beyond.
+ */
+static int size_class(size_t size)
+{
+    if (size <= SIZE_CLASS_MIN)
+        return 0;
+    int cls = (int) (sizeof(size_t) * 8) - __builtin_clzl(size - 1) -
+              __builtin_ctzl(SIZE_CLASS_MIN);
+    return cls < N_SIZE_CLASSES ? cls : N_SIZE_CLASSES - 1;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -81,13 +278,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (live_set_find(b) == live_capacity) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -115,20 +306,81 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-/* Implementation of application functions */
+/* Call site profiling */
 
-void *test_malloc(size_t size)
+static inline uint64_t profile_start()
+{
+    if (!alloc_profile)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Find or create the entry for a call site. Return NULL when table is full */
+static alloc_site_t *site_entry(void *site)
+{
+    size_t slot = (size_t) (((uintptr_t) site * 0x9e3779b97f4a7c15ULL) >> 32) &
+                  (ALLOC_SITE_SLOTS - 1);
+    for (int i = 0; i < ALLOC_SITE_SLOTS; i++) {
+        alloc_site_t *e = &alloc_sites[slot];
+        if (e->site == site)
+            return e;
+        if (!e->site) {
+            e->site = site;
+            return e;
+        }
+        slot = (slot + 1) & (ALLOC_SITE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static void profile_account(void *site,
+                            bool is_free,
+                            bool ok,
+                            size_t size,
+                            uint64_t start)
+{
+    if (!alloc_profile)
+        return;
+    alloc_site_t *e = site_entry(site);
+    if (!e)
+        return;
+    e->nsecs += profile_start() - start;
+    if (!ok)
+        return;
+    if (is_free) {
+        e->frees++;
+        e->free_bytes += size;
+    } else {
+        e->allocs++;
+        e->alloc_bytes += size;
+    }
+}
+
+#define CALL_SITE __builtin_return_address(0)
+
+/* Allocation and release of checked blocks */
+
+static void *alloc_block(size_t size, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (fail_allocation(size, site)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
+    if (!live_set_reserve()) {
+        report_event(MSG_WARN,
+                     "Couldn't grow block tracking table, malloc returning "
+                     "NULL");
+        return NULL;
+    }
+
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
@@ -142,74 +394,135 @@ void *test_malloc(size_t size)
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    if (harness_level == HARNESS_FULL)
+        memset(p, FILLCHAR, size);
+    live_set_insert(new_block);
     allocated_count++;
+    alloc_hist[size_class(size)]++;
 
     return p;
 }
 
+/* Find header of a block about to be released and verify its footer */
+static block_element_t *check_block(void *p, const char *action)
+{
+    block_element_t *b = find_header(p);
+    size_t footer = *find_footer(b);
+    if (footer != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to %s it",
+                     p, action);
+        error_occurred = true;
+    }
+    return b;
+}
+
+/* Invalidate block b, drop it from the live set and release it */
+static void release_block(block_element_t *b)
+{
+    b->magic_header = MAGICFREE;
+    *find_footer(b) = MAGICFREE;
+    if (harness_level == HARNESS_FULL)
+        memset(b->payload, FILLCHAR, b->payload_size);
+    live_set_remove(b);
+
+    free_hist[size_class(b->payload_size)]++;
+    free(b);
+    allocated_count--;
+}
+
+/* Release block at p. Return its payload size, or 0 if nothing was freed */
+static size_t free_block_at(void *p)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return 0;
+    }
+
+    if (!p)
+        return 0;
+
+    block_element_t *b = check_block(p, "free");
+    size_t size = b->payload_size;
+    release_block(b);
+    return size;
+}
+
+/* Implementation of application functions */
+
+void *test_malloc(size_t size)
+{
+    uint64_t start = profile_start();
+    void *p = alloc_block(size, CALL_SITE);
+    profile_account(CALL_SITE, false, p, size, start);
+    return p;
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
+    uint64_t start = profile_start();
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    void *ptr = alloc_block(size, CALL_SITE);
     memset(ptr, 0, size);
+    profile_account(CALL_SITE, false, ptr, size, start);
     return ptr;
 }
 
 void test_free(void *p)
 {
-    if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to free disallowed");
-        return;
-    }
+    uint64_t start = profile_start();
+    size_t size = free_block_at(p);
+    profile_account(CALL_SITE, true, p, size, start);
+}
 
-    if (!p)
-        return;
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    uint64_t start = profile_start();
+    void *new_p = NULL;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    if (!p) {
+        new_p = alloc_block(size, CALL_SITE);
+    } else if (!size) {
+        size_t old_size = free_block_at(p);
+        profile_account(CALL_SITE, true, true, old_size, start);
+        return NULL;
+    } else if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    } else {
+        block_element_t *b = check_block(p, "reallocate");
+
+        /* Always move the block, so stale pointers to the old payload are
+         * caught by the magic checks. On failure the original block is left
+         * untouched.
+         */
+        new_p = alloc_block(size, CALL_SITE);
+        if (new_p) {
+            size_t old_size = b->payload_size;
+            memcpy(new_p, p, size < old_size ? size : old_size);
+            release_block(b);
+            /* Like test_free, without counting the time twice */
+            profile_account(CALL_SITE, true, true, old_size, profile_start());
+        }
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
 
-    free(b);
-    allocated_count--;
+    profile_account(CALL_SITE, false, new_p, size, start);
+    return new_p;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
+    uint64_t start = profile_start();
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, CALL_SITE);
+    profile_account(CALL_SITE, false, new, len, start);
     if (!new)
         return NULL;
 
@@ -221,6 +534,73 @@ size_t allocation_check()
     return allocated_count;
 }
 
+size_t size_class_limit(int cls)
+{
+    return cls < N_SIZE_CLASSES - 1 ? (size_t) SIZE_CLASS_MIN << cls : 0;
+}
+
+void size_class_stats(int cls, size_t *allocs, size_t *frees)
+{
+    *allocs = alloc_hist[cls];
+    *frees = free_hist[cls];
+}
+
+void size_class_reset()
+{
+    memset(alloc_hist, 0, sizeof(alloc_hist));
+    memset(free_hist, 0, sizeof(free_hist));
+}
+
+/* Order call sites by bytes allocated, then by number of calls */
+static int cmp_sites(const void *a, const void *b)
+{
+    const alloc_site_t *sa = *(alloc_site_t *const *) a;
+    const alloc_site_t *sb = *(alloc_site_t *const *) b;
+    if (sa->alloc_bytes != sb->alloc_bytes)
+        return sa->alloc_bytes < sb->alloc_bytes ? 1 : -1;
+    size_t ca = sa->allocs + sa->frees, cb = sb->allocs + sb->frees;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void alloc_site_report(int limit)
+{
+    alloc_site_t *sorted[ALLOC_SITE_SLOTS];
+    int n = 0;
+    for (int i = 0; i < ALLOC_SITE_SLOTS; i++)
+        if (alloc_sites[i].site)
+            sorted[n++] = &alloc_sites[i];
+    qsort(sorted, n, sizeof(sorted[0]), cmp_sites);
+
+    report(1, "%-36s %10s %12s %10s %12s %10s", "call site", "allocs",
+           "bytes", "frees", "bytes", "msecs");
+    for (int i = 0; i < n && i < limit; i++) {
+        const alloc_site_t *e = sorted[i];
+        char name[64];
+        Dl_info info;
+        if (!dladdr(e->site, &info)) {
+            snprintf(name, sizeof(name), "%p", e->site);
+        } else if (info.dli_sname) {
+            snprintf(name, sizeof(name), "%s+0x%lx", info.dli_sname,
+                     (unsigned long) ((uintptr_t) e->site -
+                                      (uintptr_t) info.dli_saddr));
+        } else {
+            /* Module-relative offset, as accepted by addr2line -e <module> */
+            const char *module = strrchr(info.dli_fname, '/');
+            snprintf(name, sizeof(name), "%s+0x%lx",
+                     module ? module + 1 : info.dli_fname,
+                     (unsigned long) ((uintptr_t) e->site -
+                                      (uintptr_t) info.dli_fbase));
+        }
+        report(1, "%-36s %10zu %12zu %10zu %12zu %10.3f", name, e->allocs,
+               e->alloc_bytes, e->frees, e->free_bytes, e->nsecs / 1e6);
+    }
+}
+
+void alloc_site_reset()
+{
+    memset(alloc_sites, 0, sizeof(alloc_sites));
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -231,6 +611,93 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/* Select how thoroughly blocks are checked. Both levels track blocks the
+ * same way, so the level can change while blocks are allocated.
+ */
+bool set_harness_level(int level)
+{
+    if (level != HARNESS_FAST && level != HARNESS_FULL)
+        return false;
+    harness_level = level;
+    return true;
+}
+
+/* Fault injection schedule */
+
+static void fault_update_armed()
+{
+    fault.armed = fault.nth || fault.every || fault.above || fault.site_fn;
+}
+
+void fault_seed(unsigned long seed)
+{
+    fault.rng = seed;
+    fault.seeded = true;
+    fault.seq = 0;
+}
+
+void fault_fail_nth(size_t n)
+{
+    fault.nth = n;
+    fault.seq = 0;
+    fault_update_armed();
+}
+
+void fault_fail_every(size_t k)
+{
+    fault.every = k;
+    fault.seq = 0;
+    fault_update_armed();
+}
+
+void fault_fail_above(size_t size)
+{
+    fault.above = size;
+    fault_update_armed();
+}
+
+bool fault_fail_site(const char *symbol)
+{
+    void *fn = NULL;
+    if (symbol) {
+        fn = dlsym(RTLD_DEFAULT, symbol);
+        if (!fn)
+            return false;
+    }
+    fault.site_fn = fn;
+    fault.last_site = NULL;
+    snprintf(fault.site_name, sizeof(fault.site_name), "%s",
+             symbol ? symbol : "");
+    fault_update_armed();
+    return true;
+}
+
+void fault_clear()
+{
+    bool seeded = fault.seeded;
+    uint64_t rng = fault.rng;
+    memset(&fault, 0, sizeof(fault));
+    fault.seeded = seeded;
+    fault.rng = rng;
+}
+
+void fault_report()
+{
+    report(1, "Allocations counted: %zu", fault.seq);
+    if (fault.seeded)
+        report(1, "  seed state  0x%016llx", (unsigned long long) fault.rng);
+    if (fault.nth)
+        report(1, "  nth         %zu", fault.nth);
+    if (fault.every)
+        report(1, "  every       %zu", fault.every);
+    if (fault.above)
+        report(1, "  size        > %zu", fault.above);
+    if (fault.site_fn)
+        report(1, "  site        %s", fault.site_name);
+    if (fail_probability)
+        report(1, "  probability %d%%", fail_probability);
+}
+
 /* Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
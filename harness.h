@@ -13,23 +13,94 @@
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
+void *test_realloc(void *p, size_t size);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Allocations are counted per power-of-two payload size class, starting with
+ * payloads of at most SIZE_CLASS_MIN bytes.
+ */
+#define SIZE_CLASS_MIN 8
+#define N_SIZE_CLASSES 12
+
+/* Upper payload size bound of a size class, or 0 for the unbounded last one */
+size_t size_class_limit(int cls);
+
+/* Number of allocations and frees seen in a size class */
+void size_class_stats(int cls, size_t *allocs, size_t *frees);
+
+/* Clear size class statistics */
+void size_class_reset();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Deterministic fault injection.
+ * Allocations are numbered from 1 once any rule below is set, or whenever
+ * fail_probability is nonzero. Passing 0 (or NULL) disables a rule. With
+ * no rule set and fail_probability zero, the schedule costs one test per
+ * allocation.
+ */
+
+/* Seed the generator behind fail_probability and restart numbering */
+void fault_seed(unsigned long seed);
+
+/* Fail the nth allocation only, counted from now */
+void fault_fail_nth(size_t n);
+
+/* Fail every kth allocation, counted from now */
+void fault_fail_every(size_t k);
+
+/* Fail allocations with payload larger than size bytes */
+void fault_fail_above(size_t size);
+
+/* Fail allocations made directly from the named function.
+ * Return false if symbol cannot be resolved.
+ */
+bool fault_fail_site(const char *symbol);
+
+/* Disable all rules and restart numbering */
+void fault_clear();
+
+/* Print active rules */
+void fault_report();
+
+/* Record count, bytes and time of allocations per call site when nonzero */
+extern int alloc_profile;
+
+/* Print the top limit call sites, ordered by bytes allocated */
+void alloc_site_report(int limit);
+
+/* Clear call site statistics */
+void alloc_site_reset();
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Harness checking levels.
+ * HARNESS_FULL fills payloads with a marker byte on allocation and release.
+ * HARNESS_FAST keeps the magic header/footer checks, the cautious mode
+ * address validation and all counters, but skips the fill writes, so that
+ * performance traces measure the queue code.
+ */
+#define HARNESS_FAST 0
+#define HARNESS_FULL 1
+
+/*
+ * Select harness checking level.
+ * Return false if level is invalid.
+ */
+bool set_harness_level(int level);
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -56,6 +127,7 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -55,7 +55,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -77,6 +76,8 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+static int harness_level = HARNESS_FULL;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -103,9 +104,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -118,7 +116,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -1088,6 +1085,179 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Exercise test_realloc: resize one block through the given sizes and
+ * check that it moves every time and keeps its contents.
+ */
+static bool do_realloc(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs at least one size", argv[0]);
+        return false;
+    }
+    for (int k = 1; k < argc; k++) {
+        int size;
+        if (!get_int(argv[k], &size) || size < 1) {
+            report(1, "Invalid size '%s'", argv[k]);
+            return false;
+        }
+    }
+
+    int size;
+    get_int(argv[1], &size);
+    unsigned char *p = test_malloc(size);
+    if (!p) {
+        report(2, "Allocation of %d bytes failed", size);
+        return true;
+    }
+    for (int i = 0; i < size; i++)
+        p[i] = (unsigned char) i;
+
+    bool ok = true;
+    int moves = 0;
+    for (int k = 2; ok && k < argc; k++) {
+        int new_size;
+        get_int(argv[k], &new_size);
+        unsigned char *q = test_realloc(p, new_size);
+        if (!q) {
+            report(2, "Reallocation to %d bytes failed, keeping %d bytes",
+                   new_size, size);
+            continue;
+        }
+        if (q == p) {
+            report(1, "ERROR: Reallocation did not move the block");
+            ok = false;
+        }
+        int kept = size < new_size ? size : new_size;
+        for (int i = 0; ok && i < kept; i++) {
+            if (q[i] != (unsigned char) i) {
+                report(1, "ERROR: Byte %d lost on reallocation to %d bytes",
+                       i, new_size);
+                ok = false;
+            }
+        }
+        for (int i = kept; i < new_size; i++)
+            q[i] = (unsigned char) i;
+        p = q;
+        size = new_size;
+        moves++;
+    }
+    test_free(p);
+
+    if (ok)
+        report(1, "Block moved %d times, keeping its contents", moves);
+    return ok;
+}
+
+static bool do_allocstat(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+        report(1, "%s takes an optional 'reset' argument", argv[0]);
+        return false;
+    }
+
+    if (argc == 2) {
+        size_class_reset();
+        return true;
+    }
+
+    report(1, "%12s %12s %12s %12s", "size <=", "allocs", "frees", "live");
+    for (int cls = 0; cls < N_SIZE_CLASSES; cls++) {
+        size_t allocs, frees;
+        size_class_stats(cls, &allocs, &frees);
+        if (!allocs && !frees)
+            continue;
+        size_t limit = size_class_limit(cls);
+        if (limit)
+            report(1, "%12zu %12zu %12zu %12zd", limit, allocs, frees,
+                   (ssize_t) (allocs - frees));
+        else
+            report(1, "%12s %12zu %12zu %12zd", "larger", allocs, frees,
+                   (ssize_t) (allocs - frees));
+    }
+    report(1, "Blocks currently allocated: %zu", allocation_check());
+
+    return true;
+}
+
+static bool do_allocsites(int argc, char *argv[])
+{
+    int limit = 10;
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        alloc_site_reset();
+        return true;
+    }
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &limit) || limit < 1))) {
+        report(1, "%s takes an optional count or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!alloc_profile)
+        report(1, "Call site profiling is off; enable it with 'option "
+                  "profile 1'");
+    alloc_site_report(limit);
+    return true;
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 1) {
+        fault_report();
+        return true;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "clear")) {
+        fault_clear();
+        return true;
+    }
+
+    if (argc != 3) {
+        report(1, "%s takes a rule and its value, or 'clear'", argv[0]);
+        return false;
+    }
+
+    if (!strcmp(argv[1], "site")) {
+        bool none = !strcmp(argv[2], "none");
+        if (!fault_fail_site(none ? NULL : argv[2])) {
+            report(1, "Cannot resolve function '%s'", argv[2]);
+            return false;
+        }
+        return true;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long val = strtoul(argv[2], &end, 0);
+    if (errno || *end != '\0' || argv[2][0] == '-') {
+        report(1, "Cannot parse '%s' as non-negative integer", argv[2]);
+        return false;
+    }
+
+    if (!strcmp(argv[1], "seed"))
+        fault_seed(val);
+    else if (!strcmp(argv[1], "nth"))
+        fault_fail_nth(val);
+    else if (!strcmp(argv[1], "every"))
+        fault_fail_every(val);
+    else if (!strcmp(argv[1], "size"))
+        fault_fail_above(val);
+    else {
+        report(1, "Unknown fault rule '%s'", argv[1]);
+        return false;
+    }
+
+    return true;
+}
+
+static void harness_level_changed(int oldval)
+{
+    if (set_harness_level(harness_level))
+        return;
+
+    report(1, "Harness level must be %d (fast) or %d (full)", HARNESS_FAST,
+           HARNESS_FULL);
+    harness_level = oldval;
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1130,10 +1300,32 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(realloc,
+                "Resize a block through the given sizes, checking that it "
+                "moves and keeps its contents",
+                "size...");
+    ADD_COMMAND(allocstat,
+                "Show allocations and frees per payload size class, or clear "
+                "the statistics",
+                "[reset]");
+    ADD_COMMAND(allocsites,
+                "Show the top n allocation call sites (default: n == 10), or "
+                "clear the statistics",
+                "[n|reset]");
+    ADD_COMMAND(fault,
+                "Fail allocations deterministically: the nth one, every kth "
+                "one, those above size bytes or those made from function fn. "
+                "Without arguments, show active rules",
+                "[seed s|nth n|every k|size bytes|site fn|clear]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("harness", &harness_level,
+              "Harness checking level (0: fast, 1: full)",
+              harness_level_changed);
+    add_param("profile", &alloc_profile,
+              "Record allocation call sites (see allocsites)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
@@ -1170,8 +1362,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1185,7 +1375,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
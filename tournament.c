@@ -0,0 +1,436 @@
+/* Headless self-play: games between agents run in forked worker processes,
+ * since every agent keeps its search state (trees, transposition table,
+ * stop flag) in globals of the process. Workers send one fixed-size record
+ * per game through a shared pipe; records fit in PIPE_BUF, so writes from
+ * different workers never interleave.
+ */
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agents/mcts.h"
+#include "agents/negamax.h"
+#include "game.h"
+#include "tournament.h"
+
+int tournament_workers = 0;
+int tournament_opening = 2;
+
+enum agent_kind {
+    AGENT_MCTS,
+    AGENT_NEGAMAX,
+    AGENT_RANDOM,
+};
+
+struct agent {
+    const char *name;
+    enum agent_kind kind;
+    mcts_limits_t limits;
+    int time_ms, threads, rave, dag, tree, symmetry;
+
+    int wins, draws, losses;
+    int64_t *latencies; /* Of every move, in ns */
+    size_t n_latencies, latencies_cap;
+};
+
+struct game_record {
+    int32_t game;
+    char win; /* 'X', 'O' or 'D' */
+    uint8_t n_moves;
+    uint8_t movers[MAX_GRIDS]; /* PLAYER_INDEX of who made each move */
+    int64_t ns[MAX_GRIDS];
+};
+
+_Static_assert(sizeof(struct game_record) <= PIPE_BUF,
+               "Game records must be written atomically");
+
+/* Parse "kind[,key=value]..." into *a. Return false on any error. */
+static bool parse_agent(char *spec, struct agent *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->name = spec;
+    size_t len = strcspn(spec, ",");
+    if (len == 4 && !strncmp(spec, "mcts", len)) {
+        a->kind = AGENT_MCTS;
+        a->time_ms = a->limits.time_ms = -1;
+        a->limits.iterations = -1;
+        a->threads = mcts_threads;
+        a->rave = mcts_rave;
+        a->dag = mcts_transpositions;
+        a->tree = mcts_tree_parallel;
+    } else if (len == 7 && !strncmp(spec, "negamax", len)) {
+        a->kind = AGENT_NEGAMAX;
+        a->time_ms = negamax_time_budget;
+        a->threads = negamax_threads;
+        a->symmetry = negamax_symmetry;
+    } else if (len == 6 && !strncmp(spec, "random", len)) {
+        a->kind = AGENT_RANDOM;
+    } else {
+        return false;
+    }
+
+    for (const char *p = spec + len; *p;) {
+        p++; /* Skip the comma */
+        size_t key_len = strcspn(p, "=,");
+        if (p[key_len] != '=')
+            return false;
+        char *end;
+        long value = strtol(p + key_len + 1, &end, 10);
+        if (end == p + key_len + 1 || (*end && *end != ',') || value < 0 ||
+            value > INT_MAX)
+            return false;
+
+        int *field = NULL;
+        if (key_len == 4 && !strncmp(p, "iter", 4) && a->kind == AGENT_MCTS)
+            a->limits.iterations = value;
+        else if (key_len == 4 && !strncmp(p, "time", 4) &&
+                 a->kind != AGENT_RANDOM)
+            field = &a->time_ms;
+        else if (key_len == 7 && !strncmp(p, "threads", 7) &&
+                 a->kind != AGENT_RANDOM)
+            field = &a->threads;
+        else if (key_len == 4 && !strncmp(p, "rave", 4) &&
+                 a->kind == AGENT_MCTS)
+            field = &a->rave;
+        else if (key_len == 3 && !strncmp(p, "dag", 3) &&
+                 a->kind == AGENT_MCTS)
+            field = &a->dag;
+        else if (key_len == 4 && !strncmp(p, "tree", 4) &&
+                 a->kind == AGENT_MCTS)
+            field = &a->tree;
+        else if (key_len == 8 && !strncmp(p, "symmetry", 8) &&
+                 a->kind == AGENT_NEGAMAX)
+            field = &a->symmetry;
+        else
+            return false;
+        if (field)
+            *field = value;
+        p = end;
+    }
+
+    /* Like mcts(): a time budget alone lifts the iteration cap. iter=0
+     * lifts it too, so it needs a budget to stop the search.
+     */
+    if (a->kind == AGENT_MCTS) {
+        if (a->time_ms < 0 && a->limits.iterations <= 0)
+            a->time_ms = mcts_time_budget;
+        if (a->limits.iterations < 0)
+            a->limits.iterations = a->time_ms > 0 ? 0 : ITERATIONS;
+        if (a->time_ms < 0)
+            a->time_ms = 0;
+        if (!a->limits.iterations && !a->time_ms)
+            return false;
+        a->limits.time_ms = a->time_ms;
+    }
+    return true;
+}
+
+static int random_move(const char *table)
+{
+    int moves[MAX_GRIDS], n_moves = 0;
+    for_each_empty_grid(i, table)
+        moves[n_moves++] = i;
+    return n_moves ? moves[rand() % n_moves] : -1;
+}
+
+static int agent_move(const struct agent *a, char *table, char turn)
+{
+    switch (a->kind) {
+    case AGENT_MCTS:
+        mcts_threads = a->threads;
+        mcts_rave = a->rave;
+        mcts_transpositions = a->dag;
+        mcts_tree_parallel = a->tree;
+        return mcts_search(table, turn, &a->limits).move;
+    case AGENT_NEGAMAX:
+        negamax_time_budget = a->time_ms;
+        negamax_threads = a->threads;
+        negamax_symmetry = a->symmetry;
+        return negamax_predict(table, turn).move;
+    default:
+        return random_move(table);
+    }
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The pairs of agents in order, n_games games each, X alternating */
+static void game_players(int game, int n_games, int n_agents, int players[2])
+{
+    int pair = game / n_games;
+    int a = 0;
+    while (pair >= n_agents - 1 - a) {
+        pair -= n_agents - 1 - a;
+        a++;
+    }
+    int b = a + 1 + pair;
+    players[0] = game % n_games % 2 ? b : a;
+    players[1] = game % n_games % 2 ? a : b;
+}
+
+static void play_game(const struct agent *agents,
+                      const int players[2],
+                      struct game_record *r)
+{
+    char table[MAX_GRIDS];
+    memset(table, ' ', N_GRIDS);
+    r->n_moves = 0;
+    /* MCTS trees must not pass from one agent to another */
+    const struct agent *last_mcts = NULL;
+    char turn = 'X';
+    for (int ply = 0; (r->win = check_win(table)) == ' '; ply++) {
+        const struct agent *a = &agents[players[PLAYER_INDEX(turn) ^ 1]];
+        int move;
+        if (ply < tournament_opening) {
+            move = random_move(table);
+        } else {
+            if (a->kind == AGENT_MCTS && a != last_mcts) {
+                mcts_reset();
+                last_mcts = a;
+            }
+            int64_t start = now_ns();
+            move = agent_move(a, table, turn);
+            r->ns[r->n_moves] = now_ns() - start;
+            r->movers[r->n_moves++] = PLAYER_INDEX(turn);
+        }
+        if (move < 0 || table[move] != ' ') {
+            /* An agent that cannot move loses */
+            r->win = turn == 'X' ? 'O' : 'X';
+            break;
+        }
+        table[move] = turn;
+        turn = turn == 'X' ? 'O' : 'X';
+    }
+}
+
+static void worker(const struct agent *agents,
+                   int n_agents,
+                   int n_games,
+                   int first_game,
+                   int n_workers,
+                   int total,
+                   unsigned seed,
+                   int fd)
+{
+    for (int game = first_game; game < total; game += n_workers) {
+        struct game_record r = {.game = game};
+        int players[2];
+        game_players(game, n_games, n_agents, players);
+        srand(seed + game);
+        play_game(agents, players, &r);
+        if (write(fd, &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+    }
+    _exit(0);
+}
+
+static void add_latency(struct agent *a, int64_t ns)
+{
+    if (a->n_latencies == a->latencies_cap) {
+        a->latencies_cap = a->latencies_cap ? a->latencies_cap * 2 : 256;
+        int64_t *p = realloc(a->latencies,
+                             a->latencies_cap * sizeof(*a->latencies));
+        if (!p)
+            return;
+        a->latencies = p;
+    }
+    a->latencies[a->n_latencies++] = ns;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted latencies, in ms */
+static double percentile(const struct agent *a, double q)
+{
+    if (!a->n_latencies)
+        return 0;
+    size_t rank = (size_t) ceil(q * a->n_latencies);
+    return a->latencies[rank ? rank - 1 : 0] / 1e6;
+}
+
+/* Bradley-Terry ratings by minorization-maximization, a draw counting as
+ * half a win. One virtual draw per pairing keeps every rating finite.
+ * points[i * n + j] is what agent i scored against agent j.
+ */
+static void estimate_elo(int n, const double *points, double *elo)
+{
+    double *gamma = malloc(n * sizeof(*gamma));
+    if (!gamma)
+        return;
+    for (int i = 0; i < n; i++)
+        gamma[i] = 1;
+    for (int iter = 0; iter < 1000; iter++) {
+        double log_sum = 0;
+        for (int i = 0; i < n; i++) {
+            double won = 0, denom = 0;
+            for (int j = 0; j < n; j++) {
+                if (i == j)
+                    continue;
+                double games = points[i * n + j] + points[j * n + i] + 1;
+                won += points[i * n + j] + 0.5;
+                denom += games / (gamma[i] + gamma[j]);
+            }
+            gamma[i] = won / denom;
+            log_sum += log(gamma[i]);
+        }
+        double mean = exp(log_sum / n);
+        for (int i = 0; i < n; i++)
+            gamma[i] /= mean;
+    }
+    for (int i = 0; i < n; i++)
+        elo[i] = 400 * log10(gamma[i]);
+    free(gamma);
+}
+
+static void print_results(struct agent *agents,
+                          int n_agents,
+                          const int *wins,
+                          const int *draws,
+                          double *points)
+{
+    double *elo = calloc(n_agents, sizeof(*elo));
+    if (elo)
+        estimate_elo(n_agents, points, elo);
+
+    printf("%-28s %6s %6s %6s %6s %6s %8s %8s %8s %8s\n", "Agent", "Win",
+           "Draw", "Loss", "Score", "Elo", "p50 ms", "p90 ms", "p99 ms",
+           "max ms");
+    for (int i = 0; i < n_agents; i++) {
+        struct agent *a = &agents[i];
+        int games = a->wins + a->draws + a->losses;
+        qsort(a->latencies, a->n_latencies, sizeof(*a->latencies),
+              cmp_int64);
+        printf("%-28s %6d %6d %6d %5.1f%% %+6.0f %8.3f %8.3f %8.3f %8.3f\n",
+               a->name, a->wins, a->draws, a->losses,
+               games ? 100.0 * (a->wins + 0.5 * a->draws) / games : 0,
+               elo ? elo[i] : 0, percentile(a, 0.5), percentile(a, 0.9),
+               percentile(a, 0.99), percentile(a, 1));
+    }
+    for (int i = 0; i < n_agents; i++) {
+        for (int j = i + 1; j < n_agents; j++)
+            printf("%s vs %s: +%d =%d -%d\n", agents[i].name, agents[j].name,
+                   wins[i * n_agents + j], draws[i * n_agents + j],
+                   wins[j * n_agents + i]);
+    }
+    free(elo);
+}
+
+bool tournament(int n_games, int n_agents, char *specs[])
+{
+    if (n_games < 1 || n_agents < 2) {
+        printf("Need a positive number of games and two agents or more\n");
+        return false;
+    }
+    struct agent *agents = calloc(n_agents, sizeof(*agents));
+    int *wins = calloc(n_agents * n_agents, sizeof(*wins));
+    int *draws = calloc(n_agents * n_agents, sizeof(*draws));
+    double *points = calloc(n_agents * n_agents, sizeof(*points));
+    bool ok = agents && wins && draws && points;
+    for (int i = 0; ok && i < n_agents; i++) {
+        if (!parse_agent(specs[i], &agents[i])) {
+            printf("Cannot parse agent '%s'\n", specs[i]);
+            ok = false;
+        }
+    }
+    long total = (long) n_agents * (n_agents - 1) / 2 * n_games;
+    if (ok && total > INT_MAX) {
+        printf("Too many games\n");
+        ok = false;
+    }
+    int fds[2];
+    if (ok && pipe(fds)) {
+        perror("pipe");
+        ok = false;
+    }
+    if (!ok) {
+        free(agents);
+        free(wins);
+        free(draws);
+        free(points);
+        return false;
+    }
+
+    negamax_init();
+    int n_workers = tournament_workers > 0 ? tournament_workers
+                                           : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+        n_workers = 1;
+    if (n_workers > total)
+        n_workers = total;
+    unsigned seed = rand();
+    int64_t start = now_ns();
+    fflush(NULL);
+    int n_started = 0;
+    for (; n_started < n_workers; n_started++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (!pid) {
+            close(fds[0]);
+            worker(agents, n_agents, n_games, n_started, n_workers, total,
+                   seed, fds[1]);
+        }
+    }
+    close(fds[1]);
+    /* Games of workers that could not start are not played */
+    if (n_started < n_workers)
+        perror("fork");
+
+    struct game_record r;
+    long n_played = 0, n_moves = 0;
+    while (read(fds[0], &r, sizeof(r)) == sizeof(r)) {
+        int players[2];
+        game_players(r.game, n_games, n_agents, players);
+        int x = players[0], o = players[1];
+        if (r.win == 'D') {
+            agents[x].draws++;
+            agents[o].draws++;
+            draws[x * n_agents + o]++;
+            draws[o * n_agents + x]++;
+            points[x * n_agents + o] += 0.5;
+            points[o * n_agents + x] += 0.5;
+        } else {
+            int winner = r.win == 'X' ? x : o, loser = r.win == 'X' ? o : x;
+            agents[winner].wins++;
+            agents[loser].losses++;
+            wins[winner * n_agents + loser]++;
+            points[winner * n_agents + loser] += 1;
+        }
+        for (int i = 0; i < r.n_moves; i++)
+            add_latency(&agents[players[r.movers[i] ^ 1]], r.ns[i]);
+        n_played++;
+        n_moves += r.n_moves;
+    }
+    close(fds[0]);
+    for (int i = 0; i < n_started; i++)
+        wait(NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%ld games, %ld agent moves in %.2f s (%.1f games/s) on %d "
+           "workers\n",
+           n_played, n_moves, elapsed, n_played / elapsed, n_started);
+    print_results(agents, n_agents, wins, draws, points);
+
+    for (int i = 0; i < n_agents; i++)
+        free(agents[i].latencies);
+    free(agents);
+    free(wins);
+    free(draws);
+    free(points);
+    return n_played == total;
+}
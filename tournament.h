@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Number of processes playing games at once, 0 for one per CPU */
+extern int tournament_workers;
+
+/* Random plies played before the agents take over, so that deterministic
+ * agents do not replay the same game.
+ */
+extern int tournament_opening;
+
+/* Play n_games games between every two agents, each playing X in half of
+ * them, without drawing the board, and print wins, draws, losses, Elo
+ * estimates and move latencies. An agent is "mcts", "negamax" or "random",
+ * optionally followed by comma-separated settings:
+ *   mcts,iter=N,time=MS,rave=K,dag=0|1,threads=N,tree=0|1
+ *   negamax,time=MS,threads=N,symmetry=0|1
+ * Settings not given take the values of the matching console options.
+ * iter=0 lifts the iteration cap and needs a time budget.
+ * Return false if an agent cannot be parsed.
+ */
+bool tournament(int n_games, int n_agents, char *agents[]);
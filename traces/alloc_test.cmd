@@ -0,0 +1,18 @@
+# Allocation statistics and test_realloc, not scored
+option fail 0
+option malloc 0
+allocstat reset
+new
+ih gerbil
+it bear
+it a-string-long-enough-for-another-size-class
+# Three live elements and their strings, plus the queue head
+allocstat
+rh gerbil
+rh bear
+# realloc fails if a resize keeps the block in place or loses its contents
+realloc 8 100 3000 16 1
+# Every block but the remaining element and the head is freed
+allocstat
+free
+allocstat
@@ -0,0 +1,85 @@
+# Deterministic fault injection, not scored
+# Each insertion allocates the element, then its string
+option fail 100
+option malloc 0
+new
+# Fail the third allocation: the element of b
+fault nth 3
+ih a
+ih b
+ih c
+fault
+rh c
+rh a
+fault clear
+# Fail every third allocation: the elements of b and d
+fault every 3
+it a
+it b
+it c
+it d
+it e
+rh a
+rh c
+rh e
+fault clear
+# Fail allocations over 32 bytes: the long string only
+fault size 32
+it short
+it a-string-well-over-thirty-two-bytes-long
+it tail
+rh short
+rh tail
+fault clear
+# Fail allocations made from q_insert_tail only
+fault site q_insert_tail
+ih head
+it tail
+ih next
+rh next
+rh head
+fault site none
+fault clear
+# The same seed fails the same allocations: only c, k and l are kept
+fault seed 7
+option malloc 50
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+it h
+it i
+it j
+it k
+it l
+option malloc 0
+it end
+rh c
+rh k
+rh l
+rh end
+fault seed 7
+option malloc 50
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+it h
+it i
+it j
+it k
+it l
+option malloc 0
+it end
+rh c
+rh k
+rh l
+rh end
+fault clear
+free
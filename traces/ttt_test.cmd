@@ -0,0 +1,40 @@
+# Tic-tac-toe agents across board options and books, not scored
+# Run with make check-ttt, which first builds the book loaded below
+option tournament_workers 2
+option tournament_opening 1
+# Default board: 4 by 4, 3 in a row
+tournament 4 mcts,iter=300 negamax,time=5 random
+tournament 2 mcts,iter=300,threads=2,tree=1 mcts,iter=300,dag=1 mcts,iter=300,rave=100
+# A lifted iteration cap needs a time budget
+tournament 2 mcts,iter=0,time=5 negamax,time=5,threads=2
+option board_size 3
+tournament 4 mcts,iter=300 negamax,time=5 random
+# Exactly 4 in a row on 5 by 5
+option board_size 5
+option goal 4
+option allow_exceed 0
+tournament 2 mcts,iter=300 negamax,time=5 random
+option board_size 8
+option goal 5
+tournament 2 mcts,iter=200 negamax,time=5 random
+# No compiled line kernel for 6 in a row on 7 by 7
+option allow_exceed 1
+option board_size 7
+option goal 6
+tournament 2 mcts,iter=200 negamax,time=5 random
+# Invalid options are refused and leave the board as it was
+option goal 8
+option board_size 9
+option allow_exceed 2
+tournament 2 mcts,iter=200 random
+# The book is built for the default board
+option goal 3
+option board_size 4
+book traces/ttt.book
+tournament 4 mcts,iter=300 negamax,time=5 random
+# The book does not match this board, so the agents search instead
+option board_size 3
+tournament 2 mcts,iter=300 negamax,time=5
+option board_size 4
+book
+tournament 2 mcts,iter=300 negamax,time=5
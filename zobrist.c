@@ -1,69 +1,199 @@
 #include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mt19937-64.h"
 #include "zobrist.h"
 
-uint64_t zobrist_table[N_GRIDS][2];
+uint64_t zobrist_table[MAX_GRIDS][2];
+int symmetry_grids[N_SYMMETRIES][MAX_GRIDS];
+int symmetry_inverse[N_SYMMETRIES][MAX_GRIDS];
 
-#define HASH(key) ((key) % HASH_TABLE_SIZE)
+int zobrist_size_mb = ZOBRIST_DEFAULT_MB;
+int zobrist_policy = ZOBRIST_DEPTH_PREFERRED;
 
-static struct hlist_head *hash_table;
+#define BUCKET_ENTRIES 4
+
+/* An entry is stored as two words: data packs everything but the key, and
+ * check is key ^ data. A reader that sees the halves of two different
+ * writes finds that check ^ data is not its key, so concurrent searches
+ * can share the table without locks.
+ */
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} slot_t;
+
+typedef struct {
+    slot_t slots[BUCKET_ENTRIES];
+} __attribute__((aligned(64))) bucket_t;
+
+_Static_assert(sizeof(bucket_t) == 64, "A bucket must fill a cache line");
+
+static bucket_t *buckets;
+static uint64_t bucket_mask;
+static uint8_t generation = 1;
+
+void zobrist_init_keys(void)
+{
+    static bool keys_ready;
+    static int symmetry_size;
+    if (!keys_ready) {
+        for (int i = 0; i < MAX_GRIDS; i++) {
+            zobrist_table[i][0] = mt19937_rand();
+            zobrist_table[i][1] = mt19937_rand();
+        }
+        keys_ready = true;
+    }
+    if (symmetry_size == BOARD_SIZE)
+        return;
+
+    const int n = BOARD_SIZE - 1;
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        for (int j = 0; j < BOARD_SIZE; j++) {
+            const int images[N_SYMMETRIES] = {
+                GET_INDEX(i, j),         GET_INDEX(j, n - i),
+                GET_INDEX(n - i, n - j), GET_INDEX(n - j, i),
+                GET_INDEX(i, n - j),     GET_INDEX(n - i, j),
+                GET_INDEX(j, i),         GET_INDEX(n - j, n - i),
+            };
+            for (int k = 0; k < N_SYMMETRIES; k++) {
+                symmetry_grids[k][GET_INDEX(i, j)] = images[k];
+                symmetry_inverse[k][images[k]] = GET_INDEX(i, j);
+            }
+        }
+    }
+    symmetry_size = BOARD_SIZE;
+}
+
+/* Allocate the largest power-of-two number of buckets within size_mb */
+static bool allocate_buckets(int size_mb)
+{
+    size_t n = 1;
+    if (size_mb < 1)
+        size_mb = 1;
+    while (n * 2 * sizeof(bucket_t) <= ((size_t) size_mb << 20))
+        n *= 2;
+    void *p;
+    if (posix_memalign(&p, sizeof(bucket_t), n * sizeof(bucket_t)))
+        return false;
+    memset(p, 0, n * sizeof(bucket_t));
+    free(buckets);
+    buckets = p;
+    bucket_mask = n - 1;
+    generation = 1;
+    return true;
+}
 
 void zobrist_init(void)
 {
-    int i;
-    for (i = 0; i < N_GRIDS; i++) {
-        zobrist_table[i][0] = mt19937_rand();
-        zobrist_table[i][1] = mt19937_rand();
+    zobrist_init_keys();
+    if (buckets) {
+        zobrist_clear();
+        return;
     }
-    hash_table = malloc(sizeof(struct hlist_head) * HASH_TABLE_SIZE);
-    assert(hash_table);
-    for (i = 0; i < HASH_TABLE_SIZE; i++)
-        INIT_HLIST_HEAD(&hash_table[i]);
+    bool ok = allocate_buckets(zobrist_size_mb);
+    assert(ok);
+    (void) ok;
 }
 
-zobrist_entry_t *zobrist_get(uint64_t key)
+void zobrist_resize(int old_size_mb)
 {
-    unsigned long long hash_key = HASH(key);
-
-    if (hlist_empty(&hash_table[hash_key]))
-        return NULL;
-
-    zobrist_entry_t *entry = NULL;
-#ifdef __HAVE_TYPEOF
-    hlist_for_each_entry (entry, &hash_table[hash_key], ht_list)
-#else
-    hlist_for_each_entry (entry, &hash_table[hash_key], ht_list,
-                          zobrist_entry_t)
-#endif
-    {
-        if (entry->key == key)
-            return entry;
+    if (!buckets)
+        return;
+    if (!allocate_buckets(zobrist_size_mb)) {
+        printf("Cannot allocate %d MiB for the transposition table\n",
+               zobrist_size_mb);
+        zobrist_size_mb = old_size_mb;
     }
-    return NULL;
 }
 
-void zobrist_put(uint64_t key, int score, int move)
+static inline uint64_t pack_entry(const zobrist_entry_t *entry)
 {
-    unsigned long long hash_key = HASH(key);
-    zobrist_entry_t *new_entry = malloc(sizeof(zobrist_entry_t));
-    assert(new_entry);
-    new_entry->key = key;
-    new_entry->move = move;
-    new_entry->score = score;
-    hlist_add_head(&new_entry->ht_list, &hash_table[hash_key]);
+    return (uint64_t) (uint32_t) entry->score |
+           (uint64_t) (uint8_t) entry->move << 32 |
+           (uint64_t) entry->depth << 40 | (uint64_t) entry->bound << 48 |
+           (uint64_t) entry->generation << 56;
 }
 
-void zobrist_clear(void)
+/* Unpack slot into *entry. A torn slot yields a key nobody looks for. */
+static inline void load_slot(const slot_t *slot, zobrist_entry_t *entry)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&hash_table[i])) {
-            zobrist_entry_t *entry =
-                hlist_entry(hash_table[i].first, zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            free(entry);
+    uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+    uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+    entry->key = check ^ data;
+    entry->score = (int32_t) (uint32_t) data;
+    entry->move = (int8_t) (data >> 32);
+    entry->depth = data >> 40;
+    entry->bound = data >> 48;
+    entry->generation = data >> 56;
+}
+
+static inline void store_slot(slot_t *slot, const zobrist_entry_t *entry)
+{
+    uint64_t data = pack_entry(entry);
+    __atomic_store_n(&slot->check, entry->key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+}
+
+bool zobrist_get(uint64_t key, zobrist_entry_t *entry)
+{
+    bucket_t *bucket = &buckets[key & bucket_mask];
+    for (int i = 0; i < BUCKET_ENTRIES; i++) {
+        load_slot(&bucket->slots[i], entry);
+        if (entry->key == key && entry->generation == generation)
+            return true;
+    }
+    return false;
+}
+
+void zobrist_put(uint64_t key, int score, int move, int depth, int bound)
+{
+    bucket_t *bucket = &buckets[key & bucket_mask];
+    slot_t *victim = NULL;
+    int victim_depth = 0;
+    bool full = true;
+    for (int i = 0; i < BUCKET_ENTRIES; i++) {
+        zobrist_entry_t entry;
+        load_slot(&bucket->slots[i], &entry);
+        if (entry.generation != generation || entry.key == key) {
+            if (entry.generation == generation &&
+                zobrist_policy == ZOBRIST_DEPTH_PREFERRED &&
+                entry.depth > depth)
+                return;
+            victim = &bucket->slots[i];
+            full = false;
+            break;
         }
-        INIT_HLIST_HEAD(&hash_table[i]);
+        if (!victim || entry.depth < victim_depth) {
+            victim = &bucket->slots[i];
+            victim_depth = entry.depth;
+        }
+    }
+    if (full) {
+        if (zobrist_policy == ZOBRIST_ALWAYS_REPLACE)
+            victim = &bucket->slots[key >> 62];
+        else if (victim_depth > depth)
+            return;
     }
+    zobrist_entry_t entry = {
+        .key = key,
+        .score = score,
+        .move = move,
+        .depth = depth,
+        .bound = bound,
+        .generation = generation,
+    };
+    store_slot(victim, &entry);
+}
+
+void zobrist_clear(void)
+{
+    if (++generation)
+        return;
+    /* Entries may carry any older generation; start over after a wrap */
+    memset(buckets, 0, (bucket_mask + 1) * sizeof(bucket_t));
+    generation = 1;
 }
@@ -1,22 +1,61 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "game.h"
-#include "hlist.h"
 
-#define HASH_TABLE_SIZE ((int) 1e6 + 3)  // choose a large prime number
+/* Size of the transposition table in MiB, rounded down to a power of two */
+#define ZOBRIST_DEFAULT_MB 16
+extern int zobrist_size_mb;
 
-extern uint64_t zobrist_table[N_GRIDS][2];
+/* What zobrist_put() does when every entry of the bucket is in use */
+enum {
+    ZOBRIST_DEPTH_PREFERRED, /* Replace the shallowest entry, if not deeper */
+    ZOBRIST_ALWAYS_REPLACE,  /* Replace an entry picked by the key */
+};
+extern int zobrist_policy;
+
+extern uint64_t zobrist_table[MAX_GRIDS][2];
+
+/* The 8 symmetries of the square board, as the image of every grid under
+ * each of them, and the inverse mappings. Symmetry 0 is the identity.
+ */
+#define N_SYMMETRIES 8
+extern int symmetry_grids[N_SYMMETRIES][MAX_GRIDS];
+extern int symmetry_inverse[N_SYMMETRIES][MAX_GRIDS];
+
+/* How score relates to the true value of the position */
+enum {
+    ZOBRIST_EXACT,
+    ZOBRIST_LOWER, /* The search failed high: value >= score */
+    ZOBRIST_UPPER, /* The search failed low: value <= score */
+};
 
 typedef struct {
     uint64_t key;
-    int score;
-    int move;
-    struct hlist_node ht_list;
+    int32_t score;
+    int8_t move;
+    uint8_t depth;      /* Remaining depth the score was searched with */
+    uint8_t bound;
+    uint8_t generation; /* Entries of older generations are free */
 } zobrist_entry_t;
 
+/* Fill zobrist_table on first use, and the symmetry tables whenever the
+ * board size changed. Keys never change afterwards, so keys computed by
+ * different agents stay comparable.
+ */
+void zobrist_init_keys(void);
 void zobrist_init(void);
-zobrist_entry_t *zobrist_get(uint64_t key);
-void zobrist_put(uint64_t key, int score, int move);
+
+/* Reallocate the table after zobrist_size_mb changed, dropping entries */
+void zobrist_resize(int old_size_mb);
+
+/* Copy the entry for key into *entry. Return false if there is none.
+ * zobrist_get() and zobrist_put() may run on several threads at once.
+ */
+bool zobrist_get(uint64_t key, zobrist_entry_t *entry);
+void zobrist_put(uint64_t key, int score, int move, int depth, int bound);
+
+/* Drop every entry in O(1) */
 void zobrist_clear(void);